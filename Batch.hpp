@@ -0,0 +1,299 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+#ifndef ASSIGNMENTONE_BATCH_H
+#define ASSIGNMENTONE_BATCH_H
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include "WeatherAnalysis.hpp"
+#include "Parser.hpp"
+#include "StreamParser.hpp"
+#include "SimpleTimer.hpp"
+#include "ResultCache.hpp"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+//Batch Analysis of many files in one context
+// Runs a three stage pipeline over a list of files using a single WeatherAnalysis:
+//		file N+2..	- parsed on host threads (parse_depth files ahead)
+//		file N+1	- uploaded on the transfer queue
+//		file N		- analysed on the kernel queue
+// so the total time is bound by the slowest stage rather than the sum of all of them.
+// A quantile sketch of every file is merged as it completes so the aggregate row has approximate quartiles.
+// Files may be plain text or gzip/zstd compressed, compressed files are parsed while they are decompressed.
+// With a cache file, files whose content is already in the result cache (with their sketch) skip the pipeline, Lookup
+// tells the caller whether any file still needs the device before it sets one up. Files are recognised by their size
+// and modification time, a new or changed file is hashed by its parser as it is read so it is only read once.
+template<class T>
+class BatchAnalysis {
+public:
+	BatchAnalysis(WeatherAnalysis<T> &world, ResultCache &cache, const std::vector<std::string> &files, unsigned int parse_depth = 2)
+		: world(world), cache(cache), files(files), parse_depth(std::max(1u, parse_depth)), windows(this->parse_depth) {};
+
+	//Expands a directory into its sorted regular files, otherwise treats the path as a list file with one path per line
+	static std::vector<std::string> ListFiles(const std::string &path) {
+		std::vector<std::string> files;
+#ifndef _WIN32
+		DIR *directory = opendir(path.c_str());
+		if (directory) {
+			while (dirent *entry = readdir(directory)) {
+				std::string file = path + "/" + entry->d_name;
+				struct stat info;
+				if (stat(file.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+					files.push_back(file);
+			}
+			closedir(directory);
+			std::sort(files.begin(), files.end());
+			return files;
+		}
+#endif
+		std::ifstream list(path);
+		if (!list)
+			throw std::runtime_error("ERROR: Could not open batch list " + path);
+
+		std::string line;
+		while (std::getline(list, line)) {
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (!line.empty())
+				files.push_back(line);
+		}
+		return files;
+	};
+
+	//Answers the files found in the cache and returns how many still need the pipeline (and so a device).
+	//Only the fingerprints of the files are checked, nothing is read. Without a cache file every file is pending.
+	std::size_t Lookup(bool sort = true) {
+		this->sorted = sort;
+		this->keys.assign(this->files.size(), std::string());
+		this->states.assign(this->files.size(), ResultCache::FileState());
+
+		//Unreadable files are left to fail in the parser
+		if (this->cache.Persistent()) {
+			for (std::size_t i = 0; i < this->files.size(); ++i) {
+				this->states[i] = ResultCache::Status(this->files[i]);
+				this->keys[i] = this->cache.KnownKey(this->files[i], ResultCache::TypeKey<T>(), this->states[i]);
+			}
+		}
+
+		this->rows.assign(this->files.size(), WeatherResults());
+		this->pending.clear();
+		this->cached_sketch = QuantileSketch(this->epsilon);
+		for (std::size_t i = 0; i < this->files.size(); ++i) {
+			const ResultCache::Entry *entry = this->keys[i].empty() ? nullptr : this->cache.Find(this->keys[i], ResultCache::QueryKey(), this->Requested());
+			if (!entry || (entry->results.count > 0 && entry->sketch.empty())) {
+				this->pending.push_back(i);
+				continue;
+			}
+
+			//A sketch that does not deserialize is a miss, the file is analysed again and its entry replaced
+			if (entry->results.count > 0) {
+				try {
+					std::stringstream bytes(entry->sketch);
+					this->cached_sketch.Merge(QuantileSketch::Deserialize(bytes));
+				}
+				catch (const std::exception &) {
+					this->pending.push_back(i);
+					continue;
+				}
+			}
+			this->rows[i] = entry->results;
+		}
+		this->looked_up = true;
+		return this->pending.size();
+	};
+
+	//Runs the pipeline over every file missing from the cache, statistics are collected per file
+	void Run(bool sort = true) {
+		SimpleTimer t;
+		t.Tic();
+		if (!this->looked_up || sort != this->sorted)
+			this->Lookup(sort);
+		this->looked_up = false;
+
+		this->sketch = this->cached_sketch;
+		this->next_file = 0;
+		this->LaunchParsers();
+
+		//Prime the pipeline with the first upload
+		if (!this->parsing.empty())
+			this->StageNext();
+
+		for (std::size_t i : this->pending) {
+			this->world.SwapStagedData();
+
+			//Upload the next file while this one computes, unless its parse is still running in which
+			//case compute first rather than stalling the device on the parser
+			bool staged = false;
+			if (!this->parsing.empty() && this->parsing.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+				this->StageNext();
+				staged = true;
+			}
+
+			WeatherResults results = WeatherResults();
+			std::stringstream sketch_bytes;
+			if (this->world.GetResults().count > 0) {
+				results = this->world.Query(this->Requested());
+				QuantileSketch file_sketch = this->world.Sketch(this->epsilon);
+				this->sketch.Merge(file_sketch);
+				file_sketch.Serialize(sketch_bytes);
+			} else {
+				results.statistics = this->Requested();
+			}
+			this->rows[i] = results;
+			if (!this->keys[i].empty())
+				this->cache.Store(this->keys[i], ResultCache::QueryKey(), results).sketch = sketch_bytes.str();
+
+			if (!staged && !this->parsing.empty())
+				this->StageNext();
+		}
+
+		this->elapsed_ms = t.Toc() / 1000000;
+	};
+
+	//Prints one row per file and a final row aggregating all files
+	void PrintTable() {
+		std::stringstream table;
+		table.precision(3);
+		table << std::fixed << std::left << std::setw(40) << "File" << std::right
+			  << std::setw(12) << "Count" << std::setw(10) << "Min" << std::setw(10) << "Max"
+			  << std::setw(10) << "Average" << std::setw(10) << "Std" << std::setw(10) << "Median"
+			  << std::setw(10) << "Q1" << std::setw(10) << "Q3" << '\n';
+
+		WeatherResults total = WeatherResults();
+		double sum_squares = 0;
+		bool first = true;
+
+		for (std::size_t i = 0; i < this->rows.size(); ++i) {
+			const WeatherResults &r = this->rows[i];
+			this->PrintRow(table, this->files[i], r, this->sorted);
+
+			if (r.count == 0)
+				continue;
+
+			//Combine moments so the aggregate std is exact, quartiles come from the merged sketch
+			total.minimum = first ? r.minimum : std::min(total.minimum, r.minimum);
+			total.maximum = first ? r.maximum : std::max(total.maximum, r.maximum);
+			total.count += r.count;
+			total.sum += r.sum;
+			sum_squares += r.count * (r.std_deviation * r.std_deviation + r.average * r.average);
+			first = false;
+		}
+
+		if (total.count > 0) {
+			total.average = total.sum / total.count;
+			double variance = sum_squares / total.count - total.average * total.average;
+			total.std_deviation = sqrt(variance > 0 ? variance : 0);
+			total.median = this->sketch.Quantile(0.5);
+			total.first_quartile = this->sketch.Quantile(0.25);
+			total.third_quartile = this->sketch.Quantile(0.75);
+		}
+		this->PrintRow(table, "ALL", total, true);
+
+		std::cout << table.str();
+		std::cout << "Analysed " << this->rows.size() << " files in " << this->elapsed_ms << "ms" << std::endl;
+	};
+
+	//Merged sketch of every file analysed by the last Run
+	const QuantileSketch &GetSketch() const { return this->sketch; };
+
+	//Merges the sketch of this run into the one serialized at path (created if missing) so runs can be combined later
+	void SaveSketch(const std::string &path) {
+		QuantileSketch combined = this->sketch;
+		std::ifstream previous(path, std::ios::binary);
+		if (previous)
+			combined.Merge(QuantileSketch::Deserialize(previous));
+		previous.close();
+
+		std::ofstream out(path, std::ios::binary);
+		if (!out)
+			throw std::runtime_error("ERROR: Could not write quantile sketch " + path);
+		combined.Serialize(out);
+		std::cout << "Sketch of " << combined.Count() << " records saved to " << path
+				  << " (median " << combined.Quantile(0.5) << ")" << std::endl;
+	};
+
+private:
+	WeatherAnalysis<T> &world;
+	ResultCache &cache;
+	std::vector<std::string> files;
+	unsigned int parse_depth;
+	//Read window of every parse slot, file N uses slot N % parse_depth which file N - parse_depth has finished with
+	std::vector<Parse::Window> windows;
+	//Data key of every file (empty until it is hashed) with its state before reading, and the files the cache could
+	//not answer in order
+	std::vector<std::string> keys;
+	std::vector<ResultCache::FileState> states;
+	std::vector<std::size_t> pending;
+	bool looked_up = false;
+	std::size_t next_file = 0;
+	std::deque<std::future<std::vector<T>>> parsing;
+	std::vector<WeatherResults> rows;
+	long long int elapsed_ms = 0;
+	bool sorted = true;
+	//Rank error of the per file and merged sketches
+	double epsilon = 0.01;
+	QuantileSketch sketch, cached_sketch;
+
+	unsigned int Requested() const {
+		return STAT_MIN | STAT_MAX | STAT_SUM | STAT_STD | (this->sorted ? STAT_QUARTILES : 0);
+	};
+
+	//Runs on a parse thread, the key of the file is only written here until the parse is collected
+	std::vector<T> ParseFile(std::size_t index, Parse::Window *window, unsigned int threads) {
+		std::vector<T> data;
+		const std::string &file_path = this->files[index];
+		if (!this->cache.Persistent() || !this->keys[index].empty()) {
+			Parse::FileEOLStream(file_path, data, *window, threads);
+			return data;
+		}
+
+		ResultCache::Hasher hasher;
+		Parse::FileEOLStream(file_path, data, *window, threads, [&](const char *bytes, std::size_t size) { hasher.Update(bytes, size); });
+		this->keys[index] = this->cache.HashedKey(file_path, ResultCache::TypeKey<T>(), this->states[index], hasher.Digest());
+		return data;
+	};
+
+	//Keeps parse_depth files parsing ahead on host threads, the hardware threads are shared between them
+	void LaunchParsers() {
+		unsigned int threads = std::max(1u, std::thread::hardware_concurrency() / this->parse_depth);
+		while (this->parsing.size() < this->parse_depth && this->next_file < this->pending.size()) {
+			Parse::Window *window = &this->windows[this->next_file % this->parse_depth];
+			this->parsing.push_back(std::async(std::launch::async, &BatchAnalysis::ParseFile, this, this->pending[this->next_file++], window, threads));
+		}
+	};
+
+	void StageNext() {
+		this->world.StageData(this->parsing.front().get());
+		this->parsing.pop_front();
+		this->LaunchParsers();
+	};
+
+	static void PrintRow(std::stringstream &table, const std::string &name, const WeatherResults &r, bool quartiles) {
+		table << std::left << std::setw(40) << name << std::right << std::setw(12) << r.count;
+		if (r.count == 0) {
+			table << '\n';
+			return;
+		}
+		table << std::setw(10) << r.minimum << std::setw(10) << r.maximum << std::setw(10) << r.average
+			  << std::setw(10) << r.std_deviation;
+		if (quartiles)
+			table << std::setw(10) << r.median << std::setw(10) << r.first_quartile << std::setw(10) << r.third_quartile;
+		table << '\n';
+	};
+};
+
+#endif //ASSIGNMENTONE_BATCH_H
@@ -0,0 +1,107 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+#ifndef ASSIGNMENTONE_BUFFERPOOL_H
+#define ASSIGNMENTONE_BUFFERPOOL_H
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <vector>
+#include <map>
+#include <cstddef>
+#include "Memory.hpp"
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+//Device Buffer Pool
+// Scratch buffers are allocated on first use and rounded up to a size class. Classes step by a quarter of the power of
+// two below them, so at most a fifth of a buffer is unused. Released buffers are kept per class and handed out again,
+// so repeated analyses and later files of a batch reuse them without allocating.
+// Buffers must only be used on one in-order queue: a released buffer may be reused by the next command while
+// earlier commands reading it are still queued, which the queue order makes safe.
+class BufferPool {
+public:
+	explicit BufferPool(Memory::Ledger &ledger) : ledger(ledger) {};
+
+	//Buffer of at least bytes (READ_WRITE), recycled when one of its size class is free
+	cl::Buffer Acquire(std::size_t bytes) {
+		std::size_t size = SizeClass(bytes);
+		std::vector<cl::Buffer> &free = this->free_buffers[size];
+		if (!free.empty()) {
+			cl::Buffer buffer = free.back();
+			free.pop_back();
+			return buffer;
+		}
+
+		cl::Buffer buffer(this->context, CL_MEM_READ_WRITE, size);
+		this->allocated += size;
+		this->ledger.Track(Memory::DEVICE, "pool", this->allocated);
+		return buffer;
+	};
+
+	//Returns a buffer from Acquire for reuse, classes keep a few free buffers and release the rest
+	void Release(const cl::Buffer &buffer) {
+		std::size_t size = buffer.getInfo<CL_MEM_SIZE>();
+		std::vector<cl::Buffer> &free = this->free_buffers[size];
+		if (free.size() < MAX_FREE) {
+			free.push_back(buffer);
+			return;
+		}
+
+		this->allocated -= size;
+		this->ledger.Track(Memory::DEVICE, "pool", this->allocated);
+	};
+
+	//Releases every free buffer and allocates from the context from now on (buffers cannot move between contexts)
+	void Reset(const cl::Context &context) {
+		this->context = context;
+		for (auto const &free : this->free_buffers)
+			this->allocated -= free.first * free.second.size();
+		this->free_buffers.clear();
+		this->ledger.Track(Memory::DEVICE, "pool", this->allocated);
+	};
+
+	//Buffer on loan for the lifetime of the scope
+	class Lease {
+	public:
+		Lease(BufferPool &pool, std::size_t bytes) : pool(pool), buffer(pool.Acquire(bytes)) {};
+		//Takes over a buffer already acquired from the pool
+		Lease(BufferPool &pool, const cl::Buffer &buffer) : pool(pool), buffer(buffer) {};
+		Lease(const Lease &) = delete;
+		Lease &operator=(const Lease &) = delete;
+
+		~Lease() {
+			this->pool.Release(this->buffer);
+		};
+
+		BufferPool &pool;
+		cl::Buffer buffer;
+	};
+
+	//Allocated size of a request: 256 bytes or the next multiple of a quarter of the power of two below it
+	static std::size_t SizeClass(std::size_t bytes) {
+		if (bytes <= MIN_SIZE)
+			return MIN_SIZE;
+		std::size_t power = MIN_SIZE;
+		while (power * 2 < bytes)
+			power <<= 1;
+		std::size_t step = power / 4;
+		return (bytes + step - 1) / step * step;
+	};
+
+private:
+	static const std::size_t MIN_SIZE = 256;
+	static const std::size_t MAX_FREE = 4;
+
+	Memory::Ledger &ledger;
+	cl::Context context;
+	std::map<std::size_t, std::vector<cl::Buffer> > free_buffers;
+	//Bytes held by the pool, leased and free
+	std::size_t allocated = 0;
+};
+
+#endif //ASSIGNMENTONE_BUFFERPOOL_H
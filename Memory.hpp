@@ -0,0 +1,96 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+#ifndef ASSIGNMENTONE_MEMORY_H
+#define ASSIGNMENTONE_MEMORY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+
+//Memory accounting
+// Owners report the size of every named host and device buffer whenever it is (re)allocated or released.
+// Current and peak bytes are kept per buffer and for the totals of each side so jobs can be sized by their peak.
+namespace Memory {
+	enum Side {
+		HOST = 0, DEVICE = 1
+	};
+
+	struct Usage {
+		std::size_t current = 0, peak = 0;
+	};
+
+	struct BufferUsage {
+		std::string name;
+		Usage host, device;
+	};
+
+	class Ledger {
+	public:
+		//Sets the current size in bytes of a named buffer, zero once it is released
+		void Track(Side side, const std::string &name, std::size_t bytes) {
+			BufferUsage &buffer = this->buffers[name];
+			buffer.name = name;
+			Usage &usage = side == HOST ? buffer.host : buffer.device;
+			Usage &total = this->totals[side];
+
+			total.current = total.current - usage.current + bytes;
+			total.peak = std::max(total.peak, total.current);
+			usage.current = bytes;
+			usage.peak = std::max(usage.peak, bytes);
+		};
+
+		//Usage of every buffer reported so far, ordered by name
+		std::vector<BufferUsage> Buffers() const {
+			std::vector<BufferUsage> usage;
+			for (auto const &buffer : this->buffers)
+				usage.push_back(buffer.second);
+			return usage;
+		};
+
+		Usage Total(Side side) const {
+			return this->totals[side];
+		};
+
+		void Print(std::ostream &out) const {
+			out << "Memory (KiB):" << "\n\t" << std::left << std::setw(12) << "Buffer" << std::right
+				<< std::setw(12) << "Host" << std::setw(12) << "Host Peak" << std::setw(12) << "Device" << std::setw(12) << "Device Peak";
+			for (auto const &buffer : this->buffers)
+				PrintRow(out, buffer.first, buffer.second.host, buffer.second.device);
+			PrintRow(out, "Total", this->totals[HOST], this->totals[DEVICE]);
+			out << '\n' << std::endl;
+		};
+
+	private:
+		std::map<std::string, BufferUsage> buffers;
+		Usage totals[2];
+
+		static void PrintRow(std::ostream &out, const std::string &name, const Usage &host, const Usage &device) {
+			out << "\n\t" << std::left << std::setw(12) << name << std::right
+				<< std::setw(12) << host.current / 1024 << std::setw(12) << host.peak / 1024
+				<< std::setw(12) << device.current / 1024 << std::setw(12) << device.peak / 1024;
+		};
+	};
+
+	//Reports a temporary buffer for the lifetime of the scope
+	class Scoped {
+	public:
+		Scoped(Ledger &ledger, Side side, const std::string &name, std::size_t bytes)
+			: ledger(ledger), side(side), name(name) {
+			this->ledger.Track(side, name, bytes);
+		};
+
+		~Scoped() {
+			this->ledger.Track(this->side, this->name, 0);
+		};
+
+	private:
+		Ledger &ledger;
+		Side side;
+		std::string name;
+	};
+}
+
+#endif //ASSIGNMENTONE_MEMORY_H
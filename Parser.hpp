@@ -1,7 +1,21 @@
 //Raymond Kirk - 14474219@students.lincoln.ac.uk
 
+#ifndef ASSIGNMENTONE_PARSER_H
+#define ASSIGNMENTONE_PARSER_H
+
 #include <fstream>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
 #include "SimpleTimer.hpp"
+#include "Records.hpp"
 
 //Fast and Efficient File Parser
 // Reads the last decimal column of an input file and parses to a vector.
@@ -15,10 +29,52 @@ namespace Parse {
 		dest.push_back(::atof(data));
 	};
 
-	//File Reader/Parser
+	//Compact storage in tenths of a degree, rounded so 0.1 steps are exact
+	void NumericData(char data[], std::vector<int16_t>& dest) {
+		dest.push_back((int16_t)::lround(::atof(data) * 10));
+	};
+
+	//Parses the last decimal of every line ending ('\n') in [begin, end) of the buffer
 	template<typename T>
-	void FileEOL(std::string file_path, std::vector<T>& destination) {
+	void Lines(const char *file_contents, std::size_t begin, std::size_t end, std::vector<T>& destination) {
+		//For every char if '\n' reached parse the decimal previous
+		for (std::size_t i = begin; i < end; ++i) {
+			if (file_contents[i] == '\n') {
+				//Null terminate to support other platforms
+				char word[7] = {"     \0"};
+				long long int j = i;
+				int counter = 6;
+
+				//Go back to front for efficieny
+				while(file_contents[j] != ' ')
+					*(word + counter--) = file_contents[j--];
 
+				//Parse data to templated type
+				Parse::NumericData(word, destination);
+			}
+		};
+	};
+
+	//Compressed input formats recognised by their magic bytes, see StreamParser.hpp
+	enum Compression {
+		PLAIN = 0, GZIP = 1, ZSTD = 2
+	};
+
+	inline Compression DetectCompression(const char *contents, std::size_t size) {
+		const unsigned char *in = (const unsigned char *) contents;
+		if (size >= 2 && in[0] == 0x1f && in[1] == 0x8b)
+			return GZIP;
+		if (size >= 4 && in[0] == 0x28 && in[1] == 0xb5 && in[2] == 0x2f && in[3] == 0xfd)
+			return ZSTD;
+		return PLAIN;
+	};
+
+	inline Compression DetectCompression(const std::vector<char> &contents) {
+		return DetectCompression(contents.data(), contents.size());
+	};
+
+	//Reads the whole file into a buffer, returns its size
+	inline std::size_t ReadAll(const std::string &file_path, std::vector<char> &file_contents) {
 		//Open input stream to file
 		//Seek to the end of the file and get the position of the last char
 		std::ifstream input_file(file_path, std::ios::in | std::ios::binary | std::ios::ate);
@@ -30,27 +86,141 @@ namespace Parse {
 		input_file.seekg(0, std::ios_base::beg);
 
 		//Read into char buffer with size of file
-		char * file_contents = new char[size];
+		file_contents.resize(size + 1, '\0');
 		input_file.read(&file_contents[0], size);
 
 		//Close the file
 		input_file.close();
+		return size;
+	};
 
-		//For every char if '\n' reached parse the decimal previous
-		for (unsigned int i = 0; i < size; ++i) {
-			if (file_contents[i] == '\n') {
-				//Null terminate to support other platforms
-				char word[7] = {"     \0"};
-				int j = i, counter = 6;
+	//A last line without a line end is parsed like the others (as FileRecords does) when it has a value column,
+	//the line end is written into the spare byte ReadAll leaves. Returns the size to parse.
+	inline std::size_t TerminateLastLine(std::vector<char> &file_contents, std::size_t size) {
+		std::size_t start = size;
+		while (start > 0 && file_contents[start - 1] != '\n')
+			--start;
+		if (start == size || !memchr(&file_contents[start], ' ', size - start))
+			return size;
+		file_contents[size] = '\n';
+		return size + 1;
+	};
 
-				//Go back to front for efficieny
-				while(file_contents[j] != ' ')
-					*(word + counter--) = file_contents[j--];
+	//File Reader/Parser
+	template<typename T>
+	void FileEOL(std::string file_path, std::vector<T>& destination) {
+		std::vector<char> file_contents;
+		std::size_t size = Parse::TerminateLastLine(file_contents, Parse::ReadAll(file_path, file_contents));
 
-				//Parse data to templated type
-				Parse::NumericData(word, destination);
+		Parse::Lines(&file_contents[0], 0, size, destination);
+	};
+
+	//Multi-threaded File Reader/Parser
+	// The buffer is split at line ends into one chunk per thread, every thread parses its chunk into its own
+	// vector and the chunks are appended in file order so the result matches FileEOL.
+	template<typename T>
+	void FileEOLParallel(std::string file_path, std::vector<T>& destination, unsigned int threads) {
+		std::vector<char> file_contents;
+		std::size_t size = Parse::TerminateLastLine(file_contents, Parse::ReadAll(file_path, file_contents));
+		threads = std::max(1u, threads);
+
+		//Chunk t starts after the first line end at or past size * t / threads
+		std::vector<std::size_t> bounds(threads + 1, size);
+		bounds[0] = 0;
+		for (unsigned int t = 1; t < threads; ++t) {
+			std::size_t bound = std::max(bounds[t - 1], size / threads * t);
+			while (bound > 0 && bound < size && file_contents[bound - 1] != '\n')
+				++bound;
+			bounds[t] = bound;
+		}
+
+		std::vector<std::vector<T> > chunks(threads);
+		std::vector<std::thread> workers;
+		for (unsigned int t = 0; t < threads; ++t)
+			workers.push_back(std::thread([&, t]() {
+				Parse::Lines(&file_contents[0], bounds[t], bounds[t + 1], chunks[t]);
+			}));
+		for (auto &worker : workers)
+			worker.join();
+
+		std::size_t total = destination.size();
+		for (auto const &chunk : chunks)
+			total += chunk.size();
+		destination.reserve(total);
+		for (auto const &chunk : chunks)
+			destination.insert(destination.end(), chunk.begin(), chunk.end());
+	};
+
+	//Parses the records in [cursor, end), the buffer must be null terminated at or after end. Values go to the
+	//destination and the station/time columns are appended to columns, new station names get the next id.
+	template<typename T>
+	void RecordLines(char *cursor, char *end, std::vector<T>& destination, Records::Columns& columns) {
+		//Map names already seen to their station id, lines of the same station are usually consecutive
+		std::map<std::string, uint16_t> station_ids;
+		for (uint16_t i = 0; i < columns.station_names.size(); ++i)
+			station_ids[columns.station_names[i]] = i;
+		std::string last_name;
+		uint16_t last_id = 0;
+
+		while (cursor < end) {
+			//Station name runs until the first space
+			char *name_end = cursor;
+			while (name_end < end && *name_end != ' ' && *name_end != '\n')
+				++name_end;
+			if (name_end == end || *name_end == '\n') {
+				cursor = name_end + 1;
+				continue;
 			}
-		};
+
+			std::string name(cursor, name_end);
+			if (name != last_name || last_name.empty()) {
+				auto found = station_ids.find(name);
+				if (found == station_ids.end()) {
+					found = station_ids.insert(std::make_pair(name, (uint16_t) columns.station_names.size())).first;
+					columns.station_names.push_back(name);
+				}
+				last_name = name;
+				last_id = found->second;
+			}
+
+			int year = (int) strtol(name_end, &cursor, 10);
+			unsigned int month = (unsigned int) strtol(cursor, &cursor, 10);
+			unsigned int day = (unsigned int) strtol(cursor, &cursor, 10);
+			unsigned int hhmm = (unsigned int) strtol(cursor, &cursor, 10);
+
+			//Value is the last column, reuse the typed conversion of FileEOL
+			while (*cursor == ' ')
+				++cursor;
+			char *value_end = cursor;
+			while (value_end < end && *value_end != '\n' && *value_end != '\r' && *value_end != ' ')
+				++value_end;
+			char word[16] = {0};
+			std::size_t length = std::min<std::size_t>(value_end - cursor, sizeof(word) - 1);
+			std::copy(cursor, cursor + length, word);
+
+			Parse::NumericData(word, destination);
+			columns.stations.push_back(last_id);
+			columns.timestamps.push_back(Records::PackTimestamp(year, month, day, hhmm));
+
+			//Skip to the start of the next line
+			cursor = value_end;
+			while (cursor < end && *cursor != '\n')
+				++cursor;
+			++cursor;
+		}
+	};
+
+	//Record Reader/Parser
+	// Reads every column of a plain text file, compressed files are read by FileRecordsStream (StreamParser.hpp).
+	template<typename T>
+	void FileRecords(std::string file_path, std::vector<T>& destination, Records::Columns& columns) {
+		//Null terminate so strtol/atof stop at the end of the buffer
+		std::vector<char> file_contents;
+		std::size_t size = Parse::ReadAll(file_path, file_contents);
+		if (DetectCompression(file_contents.data(), size) != PLAIN)
+			throw std::runtime_error("ERROR: " + file_path + " is compressed, read it with Parse::FileRecordsStream.");
+
+		Parse::RecordLines(&file_contents[0], &file_contents[0] + size, destination, columns);
 	};
 
 	//Wrapper function to record time taken to parse file
@@ -69,4 +239,6 @@ namespace Parse {
 		File(file_path, data);
 		return data;
 	};
-}
\ No newline at end of file
+}
+
+#endif //ASSIGNMENTONE_PARSER_H
@@ -0,0 +1,185 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+#ifndef ASSIGNMENTONE_QUANTILESKETCH_H
+#define ASSIGNMENTONE_QUANTILESKETCH_H
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+//Mergeable Quantile Sketch
+// KLL style stack of compactors. Level h holds values that each stand for 2^h original values, when a level
+// grows past k values it is sorted and every other value is promoted to the next level. Memory is bounded by
+// k * log2(n / k) values and any two sketches (of chunks, files or runs) merge by adding levels together.
+// k is derived from the requested rank error as in KLL (epsilon ~ 1.7 / k).
+class QuantileSketch {
+public:
+	explicit QuantileSketch(double epsilon = 0.01)
+		: k(std::max<uint32_t>(8, (uint32_t) std::ceil(1.7 / epsilon))) {};
+
+	//Number of values a level holds before it is compacted
+	uint32_t Capacity() const { return this->k; };
+
+	//Total weight (number of original values) represented by the sketch
+	uint64_t Count() const { return this->n; };
+
+	void Insert(float value) {
+		this->Insert(std::vector<float>(1, value), 0);
+	};
+
+	//Adds values that were already compacted level times, each stands for 2^level values
+	void Insert(const std::vector<float> &values, uint32_t level) {
+		if (this->levels.size() <= level)
+			this->levels.resize(level + 1);
+		this->levels[level].insert(this->levels[level].end(), values.begin(), values.end());
+		this->n += (uint64_t) values.size() << level;
+		this->Compress();
+	};
+
+	void Merge(const QuantileSketch &other) {
+		if (this->levels.size() < other.levels.size())
+			this->levels.resize(other.levels.size());
+		for (std::size_t h = 0; h < other.levels.size(); ++h)
+			this->levels[h].insert(this->levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+		this->n += other.n;
+		this->Compress();
+	};
+
+	//Value at rank q * Count() for q in [0, 1]
+	double Quantile(double q) const {
+		std::vector<std::pair<float, uint64_t> > weighted;
+		for (std::size_t h = 0; h < this->levels.size(); ++h)
+			for (float value : this->levels[h])
+				weighted.push_back(std::make_pair(value, (uint64_t) 1 << h));
+
+		if (weighted.empty())
+			return 0;
+
+		std::sort(weighted.begin(), weighted.end());
+		double target = std::min(1.0, std::max(0.0, q)) * this->n;
+		uint64_t cumulative = 0;
+		for (auto const &item : weighted) {
+			cumulative += item.second;
+			if (cumulative >= target)
+				return item.first;
+		}
+		return weighted.back().first;
+	};
+
+	//Binary format: magic, k, n, level count then each level as a count and its values (host byte order)
+	void Serialize(std::ostream &out) const {
+		uint32_t header[2] = {MAGIC, this->k};
+		uint32_t level_count = (uint32_t) this->levels.size();
+		out.write((const char *) header, sizeof(header));
+		out.write((const char *) &this->n, sizeof(this->n));
+		out.write((const char *) &level_count, sizeof(level_count));
+		for (auto const &level : this->levels) {
+			uint32_t size = (uint32_t) level.size();
+			out.write((const char *) &size, sizeof(size));
+			if (size > 0)
+				out.write((const char *) &level[0], size * sizeof(float));
+		}
+	};
+
+	//Sizes are checked against the format limits and the bytes left in the input before anything is allocated, so a
+	//truncated or corrupt sketch throws instead of allocating or reading past its end
+	static QuantileSketch Deserialize(std::istream &in) {
+		uint32_t header[2] = {0, 0}, level_count = 0;
+		in.read((char *) header, sizeof(header));
+		if (!in || header[0] != MAGIC)
+			throw std::runtime_error("ERROR: Input is not a serialized quantile sketch.");
+
+		//Bytes left in a seekable input, otherwise only the format limits apply
+		std::streampos start = in.tellg();
+		uint64_t remaining = UINT64_MAX;
+		if (start != std::streampos(-1) && in.seekg(0, std::ios::end)) {
+			remaining = (uint64_t) (in.tellg() - start);
+			in.seekg(start);
+		}
+		in.clear();
+
+		QuantileSketch sketch;
+		sketch.k = header[1];
+		in.read((char *) &sketch.n, sizeof(sketch.n));
+		in.read((char *) &level_count, sizeof(level_count));
+		if (!in)
+			throw std::runtime_error("ERROR: Serialized quantile sketch is truncated.");
+		if (sketch.k < 8 || sketch.k > MAX_K || level_count > MAX_LEVELS)
+			throw std::runtime_error("ERROR: Serialized quantile sketch is corrupt.");
+		remaining -= std::min<uint64_t>(remaining, sizeof(sketch.n) + sizeof(level_count));
+
+		//Levels never hold more than k values once compacted and their weights add up to n
+		uint64_t weight = 0;
+		sketch.levels.resize(level_count);
+		for (uint32_t h = 0; h < level_count; ++h) {
+			uint32_t size = 0;
+			if (!in.read((char *) &size, sizeof(size)))
+				throw std::runtime_error("ERROR: Serialized quantile sketch is truncated.");
+			remaining -= std::min<uint64_t>(remaining, sizeof(size));
+			if (size > sketch.k)
+				throw std::runtime_error("ERROR: Serialized quantile sketch is corrupt.");
+			if ((uint64_t) size * sizeof(float) > remaining)
+				throw std::runtime_error("ERROR: Serialized quantile sketch is truncated.");
+			remaining -= (uint64_t) size * sizeof(float);
+
+			std::vector<float> &level = sketch.levels[h];
+			level.resize(size);
+			if (size > 0 && !in.read((char *) &level[0], size * sizeof(float)))
+				throw std::runtime_error("ERROR: Serialized quantile sketch is truncated.");
+			weight += (uint64_t) size << h;
+		}
+
+		if (weight != sketch.n)
+			throw std::runtime_error("ERROR: Serialized quantile sketch is corrupt.");
+		return sketch;
+	};
+
+private:
+	static const uint32_t MAGIC = 0x314B5351; //"QSK1"
+	//Largest k a sketch file may hold (epsilon below 2e-6) and level count (weights are 64 bit)
+	static const uint32_t MAX_K = 1 << 20;
+	static const uint32_t MAX_LEVELS = 64;
+
+	uint32_t k;
+	uint64_t n = 0;
+	std::vector<std::vector<float> > levels;
+	//Alternates which half survives a compaction so the rank error does not drift in one direction
+	uint32_t parity = 0;
+
+	void Compress() {
+		for (std::size_t h = 0; h < this->levels.size(); ++h) {
+			if (this->levels[h].size() <= this->k)
+				continue;
+
+			std::vector<float> &level = this->levels[h];
+			std::sort(level.begin(), level.end());
+
+			//An odd value out stays on this level so the total weight is preserved exactly
+			float leftover = level.back();
+			bool odd = level.size() % 2 == 1;
+			if (odd)
+				level.pop_back();
+
+			std::vector<float> promoted;
+			for (std::size_t i = this->parity; i < level.size(); i += 2)
+				promoted.push_back(level[i]);
+			this->parity ^= 1;
+
+			level.clear();
+			if (odd)
+				level.push_back(leftover);
+
+			if (this->levels.size() <= h + 1)
+				this->levels.resize(h + 2);
+			std::vector<float> &next = this->levels[h + 1];
+			next.insert(next.end(), promoted.begin(), promoted.end());
+		}
+	};
+};
+
+#endif //ASSIGNMENTONE_QUANTILESKETCH_H
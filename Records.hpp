@@ -0,0 +1,109 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+#ifndef ASSIGNMENTONE_RECORDS_H
+#define ASSIGNMENTONE_RECORDS_H
+
+#include <vector>
+#include <string>
+#include <limits>
+#include <cstdint>
+#include <cstdio>
+
+//Record columns and filters
+// Station and time columns parsed alongside the values so they can be filtered on the device.
+// Timestamps are packed as minutes since 1900-01-01 00:00 which fits 32 bits until the 9th millennium
+// and keeps date ranges, hour of day and joins a single integer comparison.
+namespace Records {
+	//Station id (index into station_names) and packed timestamp for every value
+	struct Columns {
+		std::vector<std::string> station_names;
+		std::vector<uint16_t> stations;
+		std::vector<uint32_t> timestamps;
+	};
+
+	//Predicate evaluated per record on the device, every condition must hold
+	struct Filter {
+		//Station names to keep, empty keeps every station
+		std::vector<std::string> stations;
+		//Inclusive packed timestamp range, see PackTimestamp
+		uint32_t time_from = 0, time_to = std::numeric_limits<uint32_t>::max();
+		//Inclusive hour of day range, wraps past midnight when hour_from > hour_to
+		unsigned int hour_from = 0, hour_to = 23;
+		//Inclusive value range in degrees
+		double value_min = -std::numeric_limits<double>::infinity(), value_max = std::numeric_limits<double>::infinity();
+	};
+
+	//Grouping of records by their columns, group ids are station, month (0-11) or station * 12 + month
+	enum Grouping {
+		GROUP_NONE = 0, GROUP_STATION = 1, GROUP_MONTH = 2, GROUP_STATION_MONTH = 3
+	};
+
+	//Keys records are ordered by on the device, ties keep the current record order
+	enum SortKey {
+		SORT_VALUE = 0, SORT_STATION_TIME = 1, SORT_TIME_STATION = 2
+	};
+
+	//Days from 1900-01-01 using the civil calendar (Howard Hinnant's days_from_civil shifted to 1900)
+	inline int32_t DaysSince1900(int year, unsigned int month, unsigned int day) {
+		year -= month <= 2;
+		int32_t era = (year >= 0 ? year : year - 399) / 400;
+		uint32_t yoe = (uint32_t)(year - era * 400);
+		uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+		uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+		return era * 146097 + (int32_t) doe - 693901;
+	};
+
+	//Packs a date and HHMM time into minutes since 1900-01-01 00:00
+	inline uint32_t PackTimestamp(int year, unsigned int month, unsigned int day, unsigned int hhmm = 0) {
+		return (uint32_t) DaysSince1900(year, month, day) * 1440u + (hhmm / 100) * 60u + hhmm % 100;
+	};
+
+	//Inverse of PackTimestamp (civil_from_days)
+	inline void UnpackTimestamp(uint32_t timestamp, int &year, unsigned int &month, unsigned int &day, unsigned int &hhmm) {
+		int32_t days = (int32_t)(timestamp / 1440u) + 693901;
+		int32_t era = (days >= 0 ? days : days - 146096) / 146097;
+		uint32_t doe = (uint32_t)(days - era * 146097);
+		uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+		uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+		uint32_t mp = (5 * doy + 2) / 153;
+		day = doy - (153 * mp + 2) / 5 + 1;
+		month = mp < 10 ? mp + 3 : mp - 9;
+		year = (int) yoe + era * 400 + (month <= 2);
+		hhmm = (timestamp % 1440u) / 60u * 100u + timestamp % 60u;
+	};
+
+	//Number of group ids for a grouping over the given number of stations
+	inline unsigned int GroupCount(Grouping grouping, std::size_t station_count) {
+		switch (grouping) {
+			case GROUP_STATION: return (unsigned int) station_count;
+			case GROUP_MONTH: return 12;
+			case GROUP_STATION_MONTH: return (unsigned int) station_count * 12;
+			default: return 1;
+		}
+	};
+
+	//Group id of a record, matches record_group in kernels.cl
+	inline unsigned int GroupOf(Grouping grouping, uint16_t station, uint32_t timestamp) {
+		int year;
+		unsigned int month, day, hhmm;
+		UnpackTimestamp(timestamp, year, month, day, hhmm);
+		switch (grouping) {
+			case GROUP_STATION: return station;
+			case GROUP_MONTH: return month - 1;
+			case GROUP_STATION_MONTH: return station * 12u + month - 1;
+			default: return 0;
+		}
+	};
+
+	//Formats a packed timestamp as YYYY-MM-DD HH:MM
+	inline std::string FormatTimestamp(uint32_t timestamp) {
+		int year;
+		unsigned int month, day, hhmm;
+		UnpackTimestamp(timestamp, year, month, day, hhmm);
+		char text[32];
+		snprintf(text, sizeof(text), "%04d-%02u-%02u %02u:%02u", year, month, day, hhmm / 100, hhmm % 100);
+		return text;
+	};
+}
+
+#endif //ASSIGNMENTONE_RECORDS_H
@@ -0,0 +1,406 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+#ifndef ASSIGNMENTONE_RESULTCACHE_H
+#define ASSIGNMENTONE_RESULTCACHE_H
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include "WeatherAnalysis.hpp"
+#include "Records.hpp"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+//Materialised Result Cache
+// Statistics computed for a dataset are kept keyed by a content hash of its source file, the element type and the
+// normalised query, so repeated queries over unchanged files are answered without parsing or touching a device.
+// Entries live in memory (server and batch) and optionally in a cache file loaded on construction and written by Save.
+//		data key	- hash of the file bytes and element type, see DataKey
+//		query key	- filter with sorted stations and full ranges left out, see QueryKey. Grouped queries are asked
+//					  as one filter per group so they share entries with the equivalent single group queries.
+// An entry records which statistics it holds (WeatherResults::statistics) and is merged as more are computed.
+// Files are only hashed again when their size or modification time changes, entries of the previous content of a
+// changed file are dropped. Hashes are in host byte order like the sketch format, cache files are not portable.
+class ResultCache {
+public:
+	//Statistics of one query and optionally the serialized quantile sketch of the data (batch mode)
+	struct Entry {
+		WeatherResults results;
+		std::string sketch;
+		uint64_t used;
+	};
+
+	//Memory only cache when path is empty, otherwise the entries of the cache file (if any) are loaded
+	explicit ResultCache(const std::string &path = "", std::size_t capacity = 4096) : path(path), capacity(std::max<std::size_t>(1, capacity)) {
+		if (!path.empty())
+			this->Load();
+	};
+
+	//Size and modification time of a file, taken before it is read so a change while reading is noticed next time
+	struct FileState {
+		bool known;
+		uint64_t size;
+		int64_t modified;
+	};
+
+	//Hash of HashFile over bytes given in order in pieces of any size
+	class Hasher {
+	public:
+		void Update(const char *data, std::size_t size) {
+			this->total += size;
+			while (size > 0) {
+				std::size_t take = std::min(size, sizeof(this->pending) - this->pending_size);
+				memcpy(this->pending + this->pending_size, data, take);
+				this->pending_size += take;
+				data += take;
+				size -= take;
+				if (this->pending_size == sizeof(this->pending)) {
+					for (int lane = 0; lane < 4; ++lane) {
+						uint64_t word;
+						memcpy(&word, this->pending + lane * 8, sizeof(word));
+						this->lanes[lane] = Rotate(this->lanes[lane] + word * PRIME2, 31) * PRIME1;
+					}
+					this->pending_size = 0;
+				}
+			}
+		};
+
+		uint64_t Digest() const {
+			uint64_t lanes[4] = {this->lanes[0], this->lanes[1], this->lanes[2], this->lanes[3]};
+			//Only the end of the data can stop part way through 32 bytes
+			for (std::size_t i = 0; i < this->pending_size; ++i)
+				lanes[i & 3] = Rotate(lanes[i & 3] ^ ((unsigned char) this->pending[i] * PRIME3), 11) * PRIME1;
+
+			uint64_t hash = this->total * PRIME3;
+			for (int lane = 0; lane < 4; ++lane)
+				hash = (hash ^ Rotate(lanes[lane] * PRIME2, 31) * PRIME1) * PRIME1 + PRIME2;
+			hash ^= hash >> 33;
+			hash *= PRIME2;
+			hash ^= hash >> 29;
+			hash *= PRIME3;
+			return hash ^ (hash >> 32);
+		};
+
+	private:
+		uint64_t lanes[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1}, total = 0;
+		char pending[32];
+		std::size_t pending_size = 0;
+	};
+
+	//Whether entries outlive the process, a memory only cache can never answer a new run
+	bool Persistent() const { return !this->path.empty(); };
+
+	//Identity of the data in a file for values of type T, safe to call from several threads
+	template<typename T>
+	std::string DataKey(const std::string &file_path) {
+		return DataKey(file_path, TypeKey<T>());
+	};
+
+	std::string DataKey(const std::string &file_path, const std::string &type) {
+		FileState state = Status(file_path);
+		std::string key = this->KnownKey(file_path, type, state);
+		return key.empty() ? this->HashedKey(file_path, type, state, HashFile(file_path)) : key;
+	};
+
+	//Data key from the fingerprint of an unchanged file without reading it, empty when the file has to be hashed
+	std::string KnownKey(const std::string &file_path, const std::string &type, const FileState &state) {
+		if (!state.known)
+			return "";
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto fingerprint = this->fingerprints.find(file_path);
+		if (fingerprint != this->fingerprints.end() && fingerprint->second.size == state.size && fingerprint->second.modified == state.modified)
+			return Hex(fingerprint->second.hash) + ':' + type;
+		return "";
+	};
+
+	//Data key of a file hashed in the state taken before reading it, its fingerprint replaces the previous one
+	std::string HashedKey(const std::string &file_path, const std::string &type, const FileState &state, uint64_t hash) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto previous = this->fingerprints.find(file_path);
+		if (previous != this->fingerprints.end()) {
+			uint64_t old_hash = previous->second.hash;
+			this->fingerprints.erase(previous);
+			this->dirty = true;
+			if (old_hash != hash)
+				this->Invalidate(old_hash);
+		}
+
+		//A file modified within the last second may change again without its modification time changing, so it
+		//is hashed again next time rather than trusting the fingerprint
+		if (state.known && state.modified < (int64_t) time(NULL) - 1) {
+			this->fingerprints[file_path] = Fingerprint{state.size, state.modified, hash};
+			this->dirty = true;
+		}
+		return Hex(hash) + ':' + type;
+	};
+
+	static FileState Status(const std::string &file_path) {
+		FileState state = FileState();
+#ifndef _WIN32
+		struct stat info;
+		if (stat(file_path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+			state.known = true;
+			state.size = (uint64_t) info.st_size;
+			state.modified = (int64_t) info.st_mtime;
+		}
+#endif
+		return state;
+	};
+
+	//Query key of the records matching the filter, equivalent filters give the same key
+	static std::string QueryKey(const Records::Filter &filter = Records::Filter()) {
+		Records::Filter full;
+		std::stringstream key;
+		key.precision(17);
+
+		std::vector<std::string> stations(filter.stations);
+		std::sort(stations.begin(), stations.end());
+		stations.erase(std::unique(stations.begin(), stations.end()), stations.end());
+		for (std::size_t i = 0; i < stations.size(); ++i)
+			key << (i == 0 ? " station=" : ",") << stations[i];
+
+		if (filter.time_from != full.time_from || filter.time_to != full.time_to)
+			key << " time=" << filter.time_from << '-' << filter.time_to;
+		//A wrapping range that covers every hour keeps every record
+		if ((filter.hour_to + 1) % 24 != filter.hour_from % 24)
+			key << " hours=" << filter.hour_from << '-' << filter.hour_to;
+		if (filter.value_min != full.value_min || filter.value_max != full.value_max)
+			key << " values=" << filter.value_min << ':' << filter.value_max;
+
+		std::string text = key.str();
+		return text.empty() ? "all" : text.substr(1);
+	};
+
+	//Element type part of the data key, statistics of the same file differ between storage types
+	template<typename T>
+	static std::string TypeKey() {
+		return std::string(std::numeric_limits<T>::is_integer ? (std::numeric_limits<T>::is_signed ? "int" : "uint") : "float")
+			   + std::to_string(sizeof(T) * 8);
+	};
+
+	//Entry holding at least the requested statistics, nullptr on a miss. Valid until the next Store.
+	const Entry *Find(const std::string &data_key, const std::string &query_key, unsigned int statistics = 0) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto entry = this->entries.find(data_key + '|' + query_key);
+		if (entry == this->entries.end() || (entry->second.results.statistics & statistics) != statistics) {
+			++this->misses;
+			return nullptr;
+		}
+		++this->hits;
+		entry->second.used = ++this->clock;
+		return &entry->second;
+	};
+
+	//Adds the results to the entry of the query, statistics already held are replaced. The least recently used
+	//entry is dropped when the cache is full.
+	Entry &Store(const std::string &data_key, const std::string &query_key, const WeatherResults &results) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto inserted = this->entries.insert(std::make_pair(data_key + '|' + query_key, Entry()));
+		Entry &entry = inserted.first->second;
+		if (inserted.second) {
+			entry.results = results;
+		} else {
+			unsigned int held = entry.results.statistics & ~results.statistics;
+			WeatherResults merged = results;
+			if (held & STAT_MIN) merged.minimum = entry.results.minimum;
+			if (held & STAT_MAX) merged.maximum = entry.results.maximum;
+			if (held & STAT_STD) merged.std_deviation = entry.results.std_deviation;
+			if (held & STAT_SUM) {
+				merged.sum = entry.results.sum;
+				merged.average = entry.results.average;
+			}
+			if (held & STAT_QUARTILES) {
+				merged.median = entry.results.median;
+				merged.first_quartile = entry.results.first_quartile;
+				merged.third_quartile = entry.results.third_quartile;
+			}
+			merged.statistics |= entry.results.statistics;
+			entry.results = merged;
+		}
+		entry.used = ++this->clock;
+		this->dirty = true;
+
+		if (this->entries.size() > this->capacity) {
+			auto oldest = this->entries.begin();
+			for (auto it = this->entries.begin(); it != this->entries.end(); ++it)
+				if (it->second.used < oldest->second.used)
+					oldest = it;
+			if (&oldest->second != &entry)
+				this->entries.erase(oldest);
+		}
+		return entry;
+	};
+
+	//Writes the cache file when anything changed, through a temporary file so a failed write keeps the old one
+	void Save() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->path.empty() || !this->dirty)
+			return;
+
+		std::string temporary = this->path + ".tmp";
+		std::ofstream out(temporary, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out)
+			throw std::runtime_error("ERROR: Could not write result cache " + temporary);
+
+		uint32_t header[2] = {MAGIC, (uint32_t) this->fingerprints.size()};
+		out.write((const char *) header, sizeof(header));
+		for (auto const &fingerprint : this->fingerprints) {
+			WriteString(out, fingerprint.first);
+			out.write((const char *) &fingerprint.second, sizeof(Fingerprint));
+		}
+
+		uint32_t entry_count = (uint32_t) this->entries.size();
+		out.write((const char *) &entry_count, sizeof(entry_count));
+		for (auto const &entry : this->entries) {
+			WriteString(out, entry.first);
+			out.write((const char *) &entry.second.results, sizeof(WeatherResults));
+			WriteString(out, entry.second.sketch);
+		}
+		out.close();
+
+		if (!out || std::rename(temporary.c_str(), this->path.c_str()) != 0)
+			throw std::runtime_error("ERROR: Could not write result cache " + this->path);
+		this->dirty = false;
+	};
+
+	std::size_t Size() const { return this->entries.size(); };
+	uint64_t Hits() const { return this->hits; };
+	uint64_t Misses() const { return this->misses; };
+
+	//Hash of the bytes of a file in four independent lanes (xxHash64 rounds) read in blocks
+	static uint64_t HashFile(const std::string &file_path) {
+		std::ifstream input(file_path, std::ios::in | std::ios::binary);
+		if (!input)
+			throw std::runtime_error("ERROR: Could not open " + file_path + ".");
+
+		Hasher hasher;
+		std::vector<char> block(HASH_BLOCK);
+		while (input) {
+			input.read(&block[0], block.size());
+			hasher.Update(block.data(), (std::size_t) input.gcount());
+		}
+		return hasher.Digest();
+	};
+
+private:
+	static const uint32_t MAGIC = 0x31434157; //"WAC1"
+	static const std::size_t HASH_BLOCK = 1 << 22;
+	static const uint64_t PRIME1 = 11400714785074694791ULL, PRIME2 = 14029467366897019727ULL, PRIME3 = 1609587929392839161ULL;
+
+	//Size and modification time of a file when it had the hash
+	struct Fingerprint {
+		uint64_t size;
+		int64_t modified;
+		uint64_t hash;
+	};
+
+	std::string path;
+	std::size_t capacity;
+	std::map<std::string, Fingerprint> fingerprints;
+	std::map<std::string, Entry> entries;
+	std::mutex mutex;
+	uint64_t clock = 0, hits = 0, misses = 0;
+	bool dirty = false;
+
+	static uint64_t Rotate(uint64_t value, int bits) {
+		return (value << bits) | (value >> (64 - bits));
+	};
+
+	static std::string Hex(uint64_t hash) {
+		char text[17];
+		snprintf(text, sizeof(text), "%016llx", (unsigned long long) hash);
+		return text;
+	};
+
+	//Drops the entries of content no file has any more
+	void Invalidate(uint64_t hash) {
+		for (auto const &fingerprint : this->fingerprints)
+			if (fingerprint.second.hash == hash)
+				return;
+
+		std::string prefix = Hex(hash) + ':';
+		for (auto it = this->entries.begin(); it != this->entries.end();) {
+			if (it->first.compare(0, prefix.size(), prefix) == 0)
+				it = this->entries.erase(it);
+			else
+				++it;
+		}
+	};
+
+	static void WriteString(std::ostream &out, const std::string &text) {
+		uint32_t size = (uint32_t) text.size();
+		out.write((const char *) &size, sizeof(size));
+		out.write(text.data(), size);
+	};
+
+	//Reads fail rather than allocate when the file has fewer bytes left than a length it claims
+	template<typename V>
+	static bool ReadValue(std::istream &in, V &value, uint64_t &remaining) {
+		if (remaining < sizeof(V) || !in.read((char *) &value, sizeof(V)))
+			return false;
+		remaining -= sizeof(V);
+		return true;
+	};
+
+	static bool ReadString(std::istream &in, std::string &text, uint64_t &remaining) {
+		uint32_t size = 0;
+		if (!ReadValue(in, size, remaining) || size > remaining)
+			return false;
+		text.resize(size);
+		if (size > 0 && !in.read(&text[0], size))
+			return false;
+		remaining -= size;
+		return true;
+	};
+
+	//A missing file is an empty cache, an unreadable or corrupt one is reported, ignored and replaced on the next Save
+	void Load() {
+		std::ifstream in(this->path, std::ios::in | std::ios::binary | std::ios::ate);
+		if (!in)
+			return;
+		std::streamoff length = in.tellg();
+		in.seekg(0, std::ios::beg);
+		uint64_t remaining = length > 0 ? (uint64_t) length : 0;
+
+		uint32_t header[2] = {0, 0}, entry_count = 0;
+		bool valid = ReadValue(in, header, remaining) && header[0] == MAGIC;
+		for (uint32_t i = 0; valid && i < header[1]; ++i) {
+			std::string file_path;
+			Fingerprint fingerprint;
+			valid = ReadString(in, file_path, remaining) && ReadValue(in, fingerprint, remaining);
+			if (valid)
+				this->fingerprints[file_path] = fingerprint;
+		}
+
+		valid = valid && ReadValue(in, entry_count, remaining);
+		for (uint32_t i = 0; valid && i < entry_count; ++i) {
+			std::string key;
+			Entry entry = Entry();
+			valid = ReadString(in, key, remaining) && ReadValue(in, entry.results, remaining) && ReadString(in, entry.sketch, remaining);
+			if (valid)
+				this->entries[key] = entry;
+		}
+
+		if (!valid) {
+			std::cerr << "Warning: ignoring unreadable result cache " << this->path << std::endl;
+			this->fingerprints.clear();
+			this->entries.clear();
+			this->dirty = true;
+		}
+	};
+};
+
+#endif //ASSIGNMENTONE_RESULTCACHE_H
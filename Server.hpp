@@ -0,0 +1,421 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+#ifndef ASSIGNMENTONE_SERVER_H
+#define ASSIGNMENTONE_SERVER_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include "WeatherAnalysis.hpp"
+#include "Records.hpp"
+#include "ResultCache.hpp"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//Avoid SIGPIPE terminating the server when a client disconnects early
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+#endif
+
+//Resident Analysis Server
+// Keeps the parsed data, device buffers and built kernels of a WeatherAnalysis alive and answers
+// line based queries over stdin or a Unix domain socket. Each line is one query:
+//		<statistic> [<statistic> ...] [<term> ...]
+//			statistic					- any of count, min, max, sum, avg, std, median, q1, q3 or all
+//			pNN							- approximate percentile from a quantile sketch, e.g. p95 or p99.9
+//			station=NAME[,NAME]			- keep only these stations
+//			from=YYYYMMDD to=YYYYMMDD	- inclusive date range
+//			hours=H-H					- inclusive hour of day range, may wrap past midnight
+//			values=LO:HI				- inclusive temperature range in degrees
+//			by=station					- one result per station
+//		help							- lists the statistics
+//		quit							- closes the connection (ends the session on stdin)
+//		shutdown						- stops the server
+// Replies are a single line, "OK name=value ..." or "ERR message".
+// Statistics are only computed once per dataset, queries arriving together from several clients
+// are batched so each missing statistic is queued on the device once for all of them.
+// Queries with terms are evaluated on the device in one fused pass per query (no quartiles).
+// Results are kept in the cache under the data key of the resident file, so repeated filters (and the
+// statistics of a restarted server with a cache file) are answered without queuing anything.
+template<class T>
+class AnalysisServer {
+public:
+	AnalysisServer(WeatherAnalysis<T> &world, ResultCache &cache, const std::string &data_key)
+		: world(world), cache(cache), data_key(data_key) {};
+
+	//Answers queries read line by line from the input stream until quit/shutdown or end of stream
+	void ServeStream(std::istream &in, std::ostream &out) {
+		std::string line;
+		while (this->running && std::getline(in, line)) {
+			std::vector<std::string> batch(1, line);
+			std::vector<std::string> replies = this->Execute(batch);
+			if (replies[0].empty())
+				break;
+			out << replies[0] << std::endl;
+		}
+	};
+
+	//Listens on a Unix domain socket and answers every connected client until shutdown
+	void ServeSocket(const std::string &socket_path) {
+#ifdef _WIN32
+		throw std::runtime_error("ERROR: Socket server is not supported on this platform, use stdin.");
+#else
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0)
+			throw std::runtime_error("ERROR: Could not create socket: " + std::string(strerror(errno)));
+
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+		unlink(socket_path.c_str());
+
+		if (bind(listener, (sockaddr *) &address, sizeof(address)) < 0 || listen(listener, 16) < 0) {
+			close(listener);
+			throw std::runtime_error("ERROR: Could not listen on " + socket_path + ": " + strerror(errno));
+		}
+
+		std::cout << "Serving queries on " << socket_path << std::endl;
+
+		//Partial lines received from each client, keyed by file descriptor
+		std::map<int, std::string> clients;
+
+		while (this->running) {
+			std::vector<pollfd> fds(1, pollfd{listener, POLLIN, 0});
+			for (auto const &client : clients)
+				fds.push_back(pollfd{client.first, POLLIN, 0});
+
+			if (poll(&fds[0], fds.size(), -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			if (fds[0].revents & POLLIN) {
+				int client = accept(listener, NULL, NULL);
+				if (client >= 0)
+					clients[client] = "";
+			}
+
+			//Gather every complete line from every ready client into one batch
+			std::vector<int> owners;
+			std::vector<std::string> batch;
+			std::vector<int> closed;
+
+			for (std::size_t i = 1; i < fds.size(); ++i) {
+				if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+					continue;
+
+				char buffer[4096];
+				ssize_t received = read(fds[i].fd, buffer, sizeof(buffer));
+				if (received <= 0) {
+					closed.push_back(fds[i].fd);
+					continue;
+				}
+
+				std::string &pending = clients[fds[i].fd];
+				pending.append(buffer, received);
+
+				std::size_t eol;
+				while ((eol = pending.find('\n')) != std::string::npos) {
+					owners.push_back(fds[i].fd);
+					batch.push_back(pending.substr(0, eol));
+					pending.erase(0, eol + 1);
+				}
+			}
+
+			std::vector<std::string> replies = this->Execute(batch);
+
+			for (std::size_t i = 0; i < replies.size(); ++i) {
+				//Empty reply means the client asked to disconnect
+				if (replies[i].empty()) {
+					closed.push_back(owners[i]);
+					continue;
+				}
+				std::string reply = replies[i] + '\n';
+				if (send(owners[i], reply.c_str(), reply.size(), SEND_FLAGS) < 0)
+					closed.push_back(owners[i]);
+			}
+
+			for (int client : closed) {
+				if (clients.erase(client))
+					close(client);
+			}
+		}
+
+		for (auto const &client : clients)
+			close(client.first);
+		close(listener);
+		unlink(socket_path.c_str());
+#endif
+	};
+
+private:
+	WeatherAnalysis<T> &world;
+	ResultCache &cache;
+	std::string data_key;
+	bool running = true;
+
+	//Statistics of the resident data, from the cache or computed by the planner and cached
+	WeatherResults Statistics(unsigned int statistics) {
+		std::string query_key = ResultCache::QueryKey();
+		const ResultCache::Entry *entry = this->cache.Find(this->data_key, query_key, statistics);
+		if (entry)
+			return entry->results;
+
+		WeatherResults results = this->world.Query(statistics);
+		this->cache.Store(this->data_key, query_key, results);
+		return results;
+	};
+
+	//Fused pass statistics of the records matching the filter, cached like the unfiltered statistics
+	WeatherResults Filtered(const Records::Filter &filter) {
+		std::string query_key = ResultCache::QueryKey(filter);
+		const ResultCache::Entry *entry = this->cache.Find(this->data_key, query_key, STAT_MIN | STAT_MAX | STAT_SUM | STAT_STD);
+		if (entry)
+			return entry->results;
+
+		WeatherResults results = this->world.FilteredStatistics(filter);
+		this->cache.Store(this->data_key, query_key, results);
+		return results;
+	};
+
+	//Maps a query word to the statistics it depends on, zero if unknown
+	static unsigned int Requires(const std::string &word) {
+		if (word == "min") return STAT_MIN;
+		if (word == "max") return STAT_MAX;
+		if (word == "sum" || word == "avg") return STAT_SUM;
+		if (word == "std") return STAT_STD;
+		if (word == "median" || word == "q1" || word == "q3") return STAT_QUARTILES;
+		if (word == "all") return STAT_ALL;
+		return 0;
+	};
+
+	static bool IsStatistic(const std::string &word) {
+		double percentile;
+		return word == "count" || Requires(word) != 0 || IsPercentile(word, percentile);
+	};
+
+	//Parses pNN into a percentile between 0 and 100
+	static bool IsPercentile(const std::string &word, double &percentile) {
+		if (word.size() < 2 || word[0] != 'p')
+			return false;
+		char *end = nullptr;
+		percentile = strtod(word.c_str() + 1, &end);
+		return *end == '\0' && percentile >= 0 && percentile <= 100;
+	};
+
+	//Appends the requested percentiles, answered from the sketch the world keeps for the resident data
+	std::string FormatPercentiles(const std::vector<std::string> &statistics) {
+		std::stringstream reply;
+		reply.precision(5);
+		reply << std::fixed;
+
+		double percentile;
+		for (auto const &word : statistics)
+			if (IsPercentile(word, percentile))
+				reply << ' ' << word << '=' << this->world.Quantile(percentile / 100);
+
+		return reply.str();
+	};
+
+	static bool IsQuartile(const std::string &word) {
+		return word == "median" || word == "q1" || word == "q3" || word == "all";
+	};
+
+	static std::vector<std::string> Split(const std::string &line, char delimiter = ' ') {
+		std::vector<std::string> words;
+		std::string word;
+		if (delimiter != ' ') {
+			std::stringstream stream(line);
+			while (std::getline(stream, word, delimiter))
+				if (!word.empty())
+					words.push_back(word);
+			return words;
+		}
+		std::stringstream stream(line);
+		while (stream >> word)
+			words.push_back(word);
+		return words;
+	};
+
+	//Executes a batch of query lines. The union of the statistics the unfiltered queries need is computed once up
+	//front, a failure there is left to the lines that need it so commands and other queries are still answered.
+	std::vector<std::string> Execute(const std::vector<std::string> &batch) {
+		unsigned int needed = 0;
+		for (auto const &line : batch) {
+			//Commands and filtered queries (their own fused pass in Answer) need nothing from the union
+			std::vector<std::string> words = Split(line);
+			if (words.empty() || line.find('=') != std::string::npos || !IsStatistic(words[0]))
+				continue;
+			for (auto const &word : words)
+				needed |= Requires(word);
+		}
+
+		if (needed != 0) {
+			try {
+				this->Statistics(needed);
+			}
+			catch (const std::exception &) {
+				//Reported by each line needing the statistics when Answer asks for them again
+			}
+		}
+
+		std::vector<std::string> replies;
+		for (auto const &line : batch) {
+			try {
+				replies.push_back(this->Answer(line));
+			}
+			catch (const std::exception &e) {
+				replies.push_back(std::string("ERR ") + e.what());
+			}
+		}
+		return replies;
+	};
+
+	//Applies one key=value term to the filter, false if it is not understood
+	static bool ParseTerm(const std::string &key, const std::string &value, Records::Filter &filter, bool &by_station) {
+		if (key == "station") {
+			filter.stations = Split(value, ',');
+			return !filter.stations.empty();
+		}
+		if (key == "from" || key == "to") {
+			unsigned int date = 0;
+			if (value.size() != 8 || sscanf(value.c_str(), "%u", &date) != 1)
+				return false;
+			unsigned int month = date / 100 % 100, day = date % 100;
+			if (month < 1 || month > 12 || day < 1 || day > 31)
+				return false;
+			if (key == "from")
+				filter.time_from = Records::PackTimestamp(date / 10000, month, day, 0);
+			else
+				filter.time_to = Records::PackTimestamp(date / 10000, month, day, 2359);
+			return true;
+		}
+		if (key == "hours")
+			return sscanf(value.c_str(), "%u-%u", &filter.hour_from, &filter.hour_to) == 2 && filter.hour_from < 24 && filter.hour_to < 24;
+		if (key == "values")
+			return sscanf(value.c_str(), "%lf:%lf", &filter.value_min, &filter.value_max) == 2;
+		if (key == "by")
+			return (by_station = value == "station");
+		return false;
+	};
+
+	//Formats the requested statistics as name=value pairs
+	static std::string Format(const WeatherResults &results, const std::vector<std::string> &statistics) {
+		std::stringstream reply;
+		reply.precision(5);
+		reply << std::fixed;
+
+		for (auto const &word : statistics) {
+			if (word == "count" || word == "all") reply << " count=" << results.count;
+			if (word == "min" || word == "all") reply << " min=" << results.minimum;
+			if (word == "max" || word == "all") reply << " max=" << results.maximum;
+			if (word == "sum" || word == "all") reply << " sum=" << results.sum;
+			if (word == "avg" || word == "all") reply << " avg=" << results.average;
+			if (word == "std" || word == "all") reply << " std=" << results.std_deviation;
+			if (word == "median" || word == "all") reply << " median=" << results.median;
+			if (word == "q1" || word == "all") reply << " q1=" << results.first_quartile;
+			if (word == "q3" || word == "all") reply << " q3=" << results.third_quartile;
+		}
+
+		return reply.str();
+	};
+
+	std::string Answer(const std::string &line) {
+		std::vector<std::string> words = Split(line);
+
+		if (words.empty())
+			return "ERR empty query";
+		if (words[0] == "quit")
+			return "";
+		if (words[0] == "shutdown") {
+			this->running = false;
+			return "OK shutdown";
+		}
+		if (words[0] == "help")
+			return "OK statistics=count,min,max,sum,avg,std,median,q1,q3,pNN,all terms=station,from,to,hours,values,by";
+
+		std::vector<std::string> statistics;
+		Records::Filter filter;
+		bool filtered = false, by_station = false;
+
+		for (auto const &word : words) {
+			std::size_t separator = word.find('=');
+			if (separator == std::string::npos) {
+				if (!IsStatistic(word))
+					return "ERR unknown statistic '" + word + "'";
+				statistics.push_back(word);
+			} else {
+				if (!ParseTerm(word.substr(0, separator), word.substr(separator + 1), filter, by_station))
+					return "ERR invalid term '" + word + "'";
+				filtered = true;
+			}
+		}
+
+		if (statistics.empty())
+			return "ERR no statistic requested";
+		if (!filtered) {
+			unsigned int needed = 0;
+			for (auto const &word : statistics)
+				needed |= Requires(word);
+			try {
+				return "OK" + Format(this->Statistics(needed), statistics) + this->FormatPercentiles(statistics);
+			}
+			catch (const std::exception &e) {
+				return std::string("ERR ") + e.what();
+			}
+		}
+
+		//Quartiles need the matching records sorted which would replace the resident dataset
+		std::vector<std::string> moments;
+		double percentile;
+		for (auto const &word : statistics) {
+			if (word == "all") {
+				std::vector<std::string> all = Split("count min max sum avg std");
+				moments.insert(moments.end(), all.begin(), all.end());
+			} else if (IsQuartile(word) || IsPercentile(word, percentile)) {
+				return "ERR quartiles and percentiles are not supported with filters";
+			} else {
+				moments.push_back(word);
+			}
+		}
+		statistics = moments;
+
+		try {
+			if (!by_station)
+				return "OK" + Format(this->Filtered(filter), statistics);
+
+			//One fused pass per station, restricted to the requested stations if any
+			std::string reply = "OK";
+			std::vector<std::string> requested = filter.stations;
+			for (auto const &name : this->world.GetStationNames()) {
+				if (!requested.empty() && std::find(requested.begin(), requested.end(), name) == requested.end())
+					continue;
+				filter.stations = std::vector<std::string>(1, name);
+				reply += " [" + name + "]" + Format(this->Filtered(filter), statistics);
+			}
+			return reply;
+		}
+		catch (const std::exception &e) {
+			return std::string("ERR ") + e.what();
+		}
+	};
+};
+
+#endif //ASSIGNMENTONE_SERVER_H
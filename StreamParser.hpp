@@ -0,0 +1,467 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+#ifndef ASSIGNMENTONE_STREAMPARSER_H
+#define ASSIGNMENTONE_STREAMPARSER_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <cstring>
+#include <memory>
+#include <functional>
+#include "Parser.hpp"
+
+#ifdef WA_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WA_ZSTD
+#include <zstd.h>
+#endif
+
+//Streaming Compressed File Parser
+// Reads gzip (WA_ZLIB), zstd (WA_ZSTD) or plain text files without holding the file or its decompressed text. The
+// file is read in windows of at most STREAM_WINDOW bytes (or the file size), decompressed in fixed size blocks that are handed to
+// Parse::Lines at line ends. Files made of independently compressed pieces (BGZF blocks or zstd frames) have the
+// complete pieces of every window split into one range per thread, every thread parses its range and the lines
+// crossing ranges and windows are joined in order, giving the same values as FileEOL on the decompressed text.
+// Any other compressed file is decoded on one thread as it is read.
+namespace Parse {
+	//Decompressed bytes produced per step, and bytes read per step when decoding sequentially
+	const std::size_t STREAM_BLOCK = 1 << 22;
+	//Compressed (or plain) bytes read per window, shared between the threads
+	const std::size_t STREAM_WINDOW = 1 << 26;
+	//A window grows up to this size to hold one whole piece, larger pieces are decoded sequentially
+	const std::size_t MAX_PIECE = 1 << 28;
+
+	//Parsed lines of a contiguous part of the text. The partial line before the first line end (head) and after the
+	//last (tail) belong to the neighbouring parts and are joined by JoinChunks.
+	template<typename T>
+	struct LineChunk {
+		std::string head, tail;
+		bool has_newline = false;
+		std::vector<T> values;
+
+		//Appends the next bytes of the part, every complete line is parsed straight from the block
+		void Feed(const char *data, std::size_t size) {
+			std::size_t start = 0;
+			if (!this->has_newline) {
+				const char *newline = (const char *) memchr(data, '\n', size);
+				if (!newline) {
+					this->head.append(data, size);
+					return;
+				}
+				start = newline - data + 1;
+				this->head.append(data, start);
+				this->has_newline = true;
+			}
+
+			std::size_t last = size;
+			while (last > start && data[last - 1] != '\n')
+				--last;
+			if (last == start) {
+				this->tail.append(data + start, size - start);
+				return;
+			}
+
+			//Finish the line carried over from the previous block
+			if (!this->tail.empty()) {
+				const char *newline = (const char *) memchr(data + start, '\n', last - start);
+				std::size_t end = newline - data + 1;
+				this->tail.append(data + start, end - start);
+				Parse::Lines(this->tail.data(), 0, this->tail.size(), this->values);
+				this->tail.clear();
+				start = end;
+			}
+
+			Parse::Lines(data, start, last, this->values);
+			this->tail.assign(data + last, size - last);
+		};
+	};
+
+	//Appends the chunks in order, parsing the lines split between them. carry holds the partial line left after
+	//the last chunk so consecutive windows join, see FinishCarry for the last line of the text.
+	template<typename T>
+	void JoinChunks(std::vector<LineChunk<T> > &chunks, std::vector<T> &destination, std::string &carry) {
+		std::size_t total = destination.size();
+		for (auto const &chunk : chunks)
+			total += chunk.values.size() + 1;
+		destination.reserve(total);
+
+		for (auto &chunk : chunks) {
+			carry += chunk.head;
+			if (!chunk.has_newline)
+				continue;
+			Parse::Lines(carry.data(), 0, carry.size(), destination);
+			destination.insert(destination.end(), chunk.values.begin(), chunk.values.end());
+			std::vector<T>().swap(chunk.values);
+			carry = chunk.tail;
+		}
+	};
+
+	//Parses a last line without a line end like FileEOL (when it has a value column)
+	template<typename T>
+	void FinishCarry(std::string &carry, std::vector<T> &destination) {
+		if (carry.find(' ') == std::string::npos)
+			return;
+		carry += '\n';
+		Parse::Lines(carry.data(), 0, carry.size(), destination);
+		carry.clear();
+	};
+
+	//Incremental decoder of one compressed stream, input may be fed in blocks of any size and consecutive gzip
+	//members or zstd frames are decoded one after another. Decompressed blocks are passed to sink(data, size).
+	class Decoder {
+	public:
+		explicit Decoder(Compression compression) : compression(compression) {
+#ifdef WA_ZLIB
+			if (compression == GZIP) {
+				memset(&this->gzip, 0, sizeof(this->gzip));
+				//15 + 32 detects the gzip header
+				if (inflateInit2(&this->gzip, 15 + 32) != Z_OK)
+					throw std::runtime_error("ERROR: Could not initialise zlib.");
+				this->block.resize(STREAM_BLOCK);
+				return;
+			}
+#endif
+#ifdef WA_ZSTD
+			if (compression == ZSTD) {
+				this->zstd = ZSTD_createDStream();
+				ZSTD_initDStream(this->zstd);
+				this->block.resize(STREAM_BLOCK);
+				return;
+			}
+#endif
+			if (compression != PLAIN)
+				throw std::runtime_error("ERROR: Compressed input is not supported by this build (needs zlib for gzip, libzstd for zstd).");
+		};
+
+		~Decoder() {
+#ifdef WA_ZLIB
+			if (this->compression == GZIP)
+				inflateEnd(&this->gzip);
+#endif
+#ifdef WA_ZSTD
+			if (this->compression == ZSTD)
+				ZSTD_freeDStream(this->zstd);
+#endif
+		};
+
+		Decoder(const Decoder &) = delete;
+		Decoder &operator=(const Decoder &) = delete;
+
+		template<typename Sink>
+		void Feed(const char *data, std::size_t size, Sink &sink) {
+			if (this->compression == PLAIN) {
+				sink(data, size);
+				return;
+			}
+#ifdef WA_ZLIB
+			if (this->compression == GZIP) {
+				this->gzip.next_in = (Bytef *) data;
+				this->gzip.avail_in = (uInt) size;
+
+				//Runs until the input is consumed and no output is pending
+				bool more = size > 0;
+				while (more) {
+					//A member that ended is followed by the next one when there is more input
+					if (this->member_ended) {
+						if (this->gzip.avail_in == 0)
+							break;
+						inflateReset(&this->gzip);
+						this->member_ended = false;
+					}
+					this->open = true;
+					this->gzip.next_out = (Bytef *) this->block.data();
+					this->gzip.avail_out = (uInt) this->block.size();
+					int status = inflate(&this->gzip, Z_NO_FLUSH);
+					if (status == Z_BUF_ERROR)
+						break;
+					if (status != Z_OK && status != Z_STREAM_END)
+						throw std::runtime_error("ERROR: Corrupt gzip input.");
+					sink(this->block.data(), this->block.size() - this->gzip.avail_out);
+					this->member_ended = status == Z_STREAM_END;
+					this->open = !this->member_ended;
+					more = this->gzip.avail_in > 0 || this->gzip.avail_out == 0;
+				}
+				return;
+			}
+#endif
+#ifdef WA_ZSTD
+			if (this->compression == ZSTD) {
+				ZSTD_inBuffer input = {data, size, 0};
+				bool more = size > 0;
+				while (more) {
+					ZSTD_outBuffer output = {this->block.data(), this->block.size(), 0};
+					std::size_t result = ZSTD_decompressStream(this->zstd, &output, &input);
+					if (ZSTD_isError(result))
+						throw std::runtime_error("ERROR: Corrupt zstd input: " + std::string(ZSTD_getErrorName(result)));
+					sink(this->block.data(), output.pos);
+					//Zero once a frame is fully decoded and flushed
+					this->open = result != 0;
+					more = input.pos < input.size || output.pos == output.size;
+				}
+			}
+#endif
+		};
+
+		//Checks the input did not stop part way through a member or frame
+		void Finish() {
+			if (this->open && this->compression == GZIP)
+				throw std::runtime_error("ERROR: Truncated gzip input.");
+			if (this->open && this->compression == ZSTD)
+				throw std::runtime_error("ERROR: Truncated zstd input.");
+		};
+
+	private:
+		Compression compression;
+		std::vector<char> block;
+		//Part way through a member or frame, and a gzip member has just ended
+		bool open = false, member_ended = false;
+#ifdef WA_ZLIB
+		z_stream gzip;
+#endif
+#ifdef WA_ZSTD
+		ZSTD_DStream *zstd = nullptr;
+#endif
+	};
+
+	//Offsets of the complete independently compressed pieces at the start of the buffer, starting with 0. Only BGZF
+	//blocks (gzip members recording their size in a "BC" extra field) and zstd frames are pieces. splittable is
+	//cleared when the data after the last piece is known not to be one (rather than being incomplete).
+	inline std::vector<std::size_t> CompletePieces(const char *contents, std::size_t size, Compression compression, bool &splittable) {
+		const unsigned char *in = (const unsigned char *) contents;
+		std::size_t position = 0;
+		std::vector<std::size_t> offsets(1, 0);
+		splittable = compression != PLAIN;
+
+		while (splittable && position < size) {
+			std::size_t piece = 0;
+			if (compression == GZIP) {
+				//ID1 ID2 CM FLG(FEXTRA) MTIME(4) XFL OS XLEN(2) then the BC subfield holding the block size - 1
+				if (position + 18 > size)
+					break;
+				if (in[position] != 0x1f || in[position + 1] != 0x8b || !(in[position + 3] & 4) ||
+					in[position + 12] != 'B' || in[position + 13] != 'C') {
+					splittable = false;
+					break;
+				}
+				piece = (std::size_t) (in[position + 16] | in[position + 17] << 8) + 1;
+			}
+#ifdef WA_ZSTD
+			else if (compression == ZSTD) {
+				//An error is a frame that does not fit in the buffer yet or is corrupt, the decoder tells them apart
+				piece = ZSTD_findFrameCompressedSize(in + position, size - position);
+				if (ZSTD_isError(piece))
+					break;
+			}
+#endif
+			else {
+				splittable = false;
+				break;
+			}
+			if (position + piece > size)
+				break;
+			position += piece;
+			offsets.push_back(position);
+		}
+		return offsets;
+	};
+
+	//Read buffer of FileEOLStream, grown without zero filling and kept between files so it is allocated once
+	class Window {
+	public:
+		char *Data() { return this->bytes.get(); };
+		std::size_t Size() const { return this->size; };
+
+		//Growing keeps the current bytes, shrinking keeps the allocation
+		void Resize(std::size_t size) {
+			if (size > this->capacity) {
+				std::unique_ptr<char[]> grown(new char[size]);
+				if (this->size > 0)
+					std::memcpy(grown.get(), this->bytes.get(), this->size);
+				this->bytes.swap(grown);
+				this->capacity = size;
+			}
+			this->size = size;
+		};
+
+	private:
+		std::unique_ptr<char[]> bytes;
+		std::size_t size = 0, capacity = 0;
+	};
+
+	//Compressed File Reader/Parser
+	// Same values as FileEOL for plain, gzip or zstd files. threads = 0 uses every hardware thread. Pass the same
+	// window to parse many files without allocating one per file. The observer sees the file bytes in order as
+	// they are read, so they can be hashed without reading the file again.
+	template<typename T>
+	void FileEOLStream(std::string file_path, std::vector<T>& destination, Window &window, unsigned int threads = 0,
+					   const std::function<void(const char *, std::size_t)> &observer = nullptr) {
+		std::ifstream input(file_path, std::ios::in | std::ios::binary);
+		if (!input)
+			throw std::runtime_error("ERROR: Could not open " + file_path + ".");
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+
+		//Files smaller than a window are read in one go into a window of their size
+		input.seekg(0, std::ios::end);
+		std::streamoff length = input.tellg();
+		input.seekg(0, std::ios::beg);
+		window.Resize(length < 0 ? STREAM_WINDOW : std::max<std::size_t>(1, std::min<std::size_t>(STREAM_WINDOW, (std::size_t) length)));
+
+		auto read = [&](char *at, std::size_t size) {
+			input.read(at, size);
+			std::size_t count = (std::size_t) input.gcount();
+			if (observer && count > 0)
+				observer(at, count);
+			return count;
+		};
+
+		std::size_t used = 0;
+		bool end_of_file = false;
+		std::string carry;
+
+		used = read(window.Data(), window.Size());
+		end_of_file = !input;
+		Compression compression = DetectCompression(window.Data(), used);
+
+		while (used > 0) {
+			//Plain text splits anywhere since lines crossing ranges are joined afterwards, a block per range at least
+			std::vector<std::size_t> offsets;
+			bool splittable = true;
+			if (compression == PLAIN) {
+				unsigned int ranges = (unsigned int) std::max<std::size_t>(1, std::min<std::size_t>(threads, used / STREAM_BLOCK));
+				for (unsigned int t = 0; t <= ranges; ++t)
+					offsets.push_back(used / ranges * t + (t == ranges ? used % ranges : 0));
+			} else {
+				offsets = CompletePieces(window.Data(), used, compression, splittable);
+			}
+
+			if (offsets.size() == 1) {
+				//Not a whole piece in the window: read more of it, or decode the rest of the file as one stream
+				if (!end_of_file && splittable && window.Size() < MAX_PIECE) {
+					window.Resize(window.Size() * 2);
+				} else {
+					std::vector<LineChunk<T> > chunks(1);
+					auto sink = [&](const char *data, std::size_t size) { chunks[0].Feed(data, size); };
+					Decoder decoder(compression);
+					decoder.Feed(window.Data(), used, sink);
+					window.Resize(std::min(window.Size(), STREAM_BLOCK));
+					while (input) {
+						std::size_t count = read(window.Data(), window.Size());
+						decoder.Feed(window.Data(), count, sink);
+					}
+					decoder.Finish();
+					JoinChunks(chunks, destination, carry);
+					break;
+				}
+			} else {
+				//Equal numbers of pieces per thread, pieces are similar in size. Errors are rethrown on this thread.
+				std::size_t pieces = offsets.size() - 1;
+				unsigned int workers_used = (unsigned int) std::min<std::size_t>(threads, pieces);
+				std::vector<LineChunk<T> > chunks(workers_used);
+				std::vector<std::exception_ptr> errors(workers_used);
+				std::vector<std::thread> workers;
+				for (unsigned int t = 0; t < workers_used; ++t) {
+					std::size_t begin = offsets[pieces * t / workers_used], end = offsets[pieces * (t + 1) / workers_used];
+					auto work = [&, t, begin, end]() {
+						try {
+							auto sink = [&](const char *data, std::size_t size) { chunks[t].Feed(data, size); };
+							Decoder decoder(compression);
+							decoder.Feed(window.Data() + begin, end - begin, sink);
+							decoder.Finish();
+						}
+						catch (...) {
+							errors[t] = std::current_exception();
+						}
+					};
+					if (workers_used == 1)
+						work();
+					else
+						workers.push_back(std::thread(work));
+				}
+				for (auto &worker : workers)
+					worker.join();
+				for (auto const &error : errors)
+					if (error)
+						std::rethrow_exception(error);
+				JoinChunks(chunks, destination, carry);
+
+				//Keep the incomplete piece at the start of the window
+				std::size_t consumed = offsets.back();
+				std::memmove(window.Data(), window.Data() + consumed, used - consumed);
+				used -= consumed;
+			}
+
+			if (!end_of_file) {
+				used += read(window.Data() + used, window.Size() - used);
+				end_of_file = !input;
+			}
+		}
+		FinishCarry(carry, destination);
+	};
+
+	template<typename T>
+	void FileEOLStream(std::string file_path, std::vector<T>& destination, unsigned int threads = 0) {
+		Window window;
+		Parse::FileEOLStream(file_path, destination, window, threads);
+	};
+
+	//Compressed Record Reader/Parser
+	// Same records as FileRecords for plain, gzip or zstd files. Compressed files are decoded on one thread as
+	// they are read (station ids follow the order of first appearance) and only the partial last line is held.
+	template<typename T>
+	void FileRecordsStream(std::string file_path, std::vector<T>& destination, Records::Columns& columns) {
+		std::ifstream input(file_path, std::ios::in | std::ios::binary);
+		if (!input)
+			throw std::runtime_error("ERROR: Could not open " + file_path + ".");
+
+		std::vector<char> block(STREAM_BLOCK);
+		input.read(&block[0], block.size());
+		std::size_t size = (std::size_t) input.gcount();
+		Compression compression = DetectCompression(block.data(), size);
+		if (compression == PLAIN) {
+			input.close();
+			Parse::FileRecords(file_path, destination, columns);
+			return;
+		}
+
+		//Complete lines are parsed as soon as they are decoded, std::string keeps the text null terminated
+		std::string pending;
+		auto sink = [&](const char *data, std::size_t length) {
+			pending.append(data, length);
+			std::size_t last = pending.rfind('\n');
+			if (last == std::string::npos)
+				return;
+			Parse::RecordLines(&pending[0], &pending[0] + last + 1, destination, columns);
+			pending.erase(0, last + 1);
+		};
+
+		Decoder decoder(compression);
+		decoder.Feed(block.data(), size, sink);
+		while (input) {
+			input.read(&block[0], block.size());
+			decoder.Feed(block.data(), (std::size_t) input.gcount(), sink);
+		}
+		decoder.Finish();
+
+		//FileRecords also parses a last line without a line end
+		if (!pending.empty())
+			Parse::RecordLines(&pending[0], &pending[0] + pending.size(), destination, columns);
+	};
+
+	//Wrapper function to record time taken to parse every column of a plain or compressed file
+	template<typename T>
+	void RecordFile(std::string file_path, std::vector<T>& destination, Records::Columns& columns) {
+		SimpleTimer t;
+		t.Tic();
+		Parse::FileRecordsStream(file_path, destination, columns);
+		std::cout << "Records Parsed in " << t.Toc() / 1000000 << "ms" << std::endl;
+	};
+}
+
+#endif //ASSIGNMENTONE_STREAMPARSER_H
@@ -67,6 +67,10 @@ void print_help() {
 	std::cerr << "  -p : select platform " << std::endl;
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -s : serve queries on a unix socket path, or stdin with '-'" << std::endl;
+	std::cerr << "  -b : analyse every file (plain, .gz or .zst) in a directory or list file in one batch" << std::endl;
+	std::cerr << "  -q : merge the quantile sketch of a batch into a sketch file" << std::endl;
+	std::cerr << "  -c : keep statistics in a result cache file, unchanged files are answered without the device" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
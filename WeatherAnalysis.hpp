@@ -8,7 +8,13 @@
 
 #include <vector>
 #include <string>
+#include <map>
+#include <cstdint>
 #include "SimpleTimer.hpp"
+#include "Records.hpp"
+#include "QuantileSketch.hpp"
+#include "Memory.hpp"
+#include "BufferPool.hpp"
 
 #ifdef __APPLE__
 #include <OpenCL/cl.hpp>
@@ -16,27 +22,88 @@
 #include <CL/cl.hpp>
 #endif
 
+//Accumulator type policy
+// Wider type used to sum values of the storage type so totals and variance cannot overflow or lose precision.
+// Float accumulates in double on the device only where cl_khr_fp64 is available, the host always uses double.
+template<class T> struct Accumulator;
+template<> struct Accumulator<int> { typedef int64_t type; };
+template<> struct Accumulator<int16_t> { typedef int64_t type; };
+template<> struct Accumulator<float> { typedef double type; };
+
+//Statistics a query can request, combined as flags. The sum also gives the average and the count is always known.
+enum Statistic {
+	STAT_MIN = 1, STAT_MAX = 2, STAT_SUM = 4, STAT_STD = 8, STAT_QUARTILES = 16,
+	STAT_ALL = STAT_MIN | STAT_MAX | STAT_SUM | STAT_STD | STAT_QUARTILES
+};
+
+//Statistics converted from storage units to degrees, statistics flags the values that have been computed
+struct WeatherResults {
+	std::size_t count;
+	double minimum, maximum, sum, average, std_deviation, median, first_quartile, third_quartile;
+	unsigned int statistics;
+};
+
+//Value of a single record in degrees with its position in the current data and its columns when available
+struct WeatherRecord {
+	double value;
+	uint32_t index;
+	std::string station;
+	uint32_t timestamp;
+};
+
+//Record flagged by DetectAnomalies with its z-score against the baseline of its group
+struct WeatherAnomaly {
+	WeatherRecord record;
+	unsigned int group;
+	double z_score;
+};
+
+//Station by station matrices (row-major, degrees) over the timestamps where both stations have a record.
+//samples counts those shared timestamps, correlation is NaN when a pair shares fewer than two or has no variance.
+struct CorrelationMatrix {
+	std::vector<std::string> stations;
+	std::vector<double> covariance, correlation;
+	std::vector<uint64_t> samples;
+};
+
 //OpenCL Parallel Weather Analysis Class
-// User Friendly Analysis class for any int/float vectors. Fully templated to support multiple types
+// User Friendly Analysis class for any int/float/int16 (tenths of a degree) vectors. Fully templated to support multiple types
 // and provides greater abstraction from low-level OpenCL features.
 template<class T>
 class WeatherAnalysis {
 public:
-    WeatherAnalysis(std::vector<T> &);
+	typedef typename Accumulator<T>::type acc_t;
+
+	//Takes ownership of the data, move it in so only one host copy exists.
+    WeatherAnalysis(std::vector<T> = std::vector<T>());
 	//Configures options from command-line arguments such as device and platform.
 	void CmdParser(int&, char**&);
 	//Initialises context and queue.
 	void Initialise(const std::string);
-	//Builds the program and kernels from the opencl/kernels.cl.
+	//Detects device features for the opencl/kernels.cl build options, program variants are built on first use.
 	void Build();
-	//Allows the user to customise frequently changed values such as Local Size and Neutral Pad Value.
-	void Configure(int = 1024, T = 0);
+	//Allows the user to customise frequently changed values such as Local Size, Neutral Pad Value and the number
+	//of elements each work item folds in the reductions. Kernels are specialised for these values, the local size
+	//is rounded down to a power of two.
+	void Configure(int = 1024, T = 0, int = 1);
 	//Pads the data so that local size is a factor of the data size. Automatically re-configures appropriate options.
 	void PadData(T = 0, bool = true);
 	//Writes all of the buffers to the device at once for use throughout the class. Self-manages buffer sizes.
 	void WriteDataToDevice();
+	//Pads the next dataset and uploads it in the background while the current one is analysed.
+	void StageData(std::vector<T>);
+	//Waits for the staged upload and makes it the current dataset, resetting all statistics.
+	void SwapStagedData();
+	//Uploads the station and timestamp columns used by filters and releases them, only the station names are kept.
+	//Call after WriteDataToDevice and move the columns in so the host copy is not retained.
+	void SetColumns(Records::Columns);
+	//Count, min, max, sum, average and std of the records matching the filter in a single device pass.
+	WeatherResults FilteredStatistics(const Records::Filter &);
+	//Compacts the matching records on the device and makes them the current dataset.
+	void Select(const Records::Filter &);
 	//Print class used to check current model of statistics.
 	void PrintResults();
+	static void PrintResults(const WeatherResults &);
 	//Function print kernel specific options such as preffered queue size.
 	void PrintQueueOptions(const cl::Kernel&);
 	//Sets a flag determining if PrintQueueOptions is called (Default: false)
@@ -49,6 +116,17 @@ public:
 	void SetKernelWorkGroupRecursion(bool = true);
 	//Prints an estimation of results that should be simular to parallel ones.
     void PrintBaselineResults();
+	//Returns the statistics computed so far in degrees.
+	WeatherResults GetResults() const;
+	//Computes the requested statistics (Statistic flags) with the fewest passes, skipping those already computed for
+	//the current data: moments are fused into one pass and quartiles are selected from histograms instead of sorted.
+	WeatherResults Query(unsigned int);
+	//Degrees per stored unit, 0.1 for int16 tenths and 1 otherwise.
+	float GetScale() const { return this->scale; };
+	//Station names indexed by the station ids of the record columns.
+	const std::vector<std::string> &GetStationNames() const { return this->station_names; };
+	//Current and peak host and device bytes of every buffer held by the class.
+	const Memory::Ledger &GetMemoryUsage() const { return this->memory; };
 	//Kernel Functions
 	void Min(); 
 	void Max();
@@ -56,41 +134,121 @@ public:
     void Average();
     void StdDeviation();
     void Sort();
+	//Min, max, sum and std in one fused pass
+	void Moments();
+	//Exact median and quartiles by radix selection, at most four passes
+	void Quartiles();
+	//Smallest/largest record, ties resolve to the lowest index
+	WeatherRecord ArgMin();
+	WeatherRecord ArgMax();
+	//Largest/smallest k records in order without a full sort, k must not exceed half the local size
+	std::vector<WeatherRecord> TopK(unsigned int);
+	std::vector<WeatherRecord> BottomK(unsigned int);
+	//Flags records more than threshold standard deviations from the mean of their group. Optional per group
+	//thresholds are indexed by group id (see Records::GroupOf). Requires record columns.
+	std::vector<WeatherAnomaly> DetectAnomalies(float, Records::Grouping = Records::GROUP_NONE, const std::vector<float> & = std::vector<float>());
+	//Record indices ordered by the key with a device key-value sort, by value, station then timestamp or timestamp then station (requires columns).
+	std::vector<uint32_t> SortedIndices(Records::SortKey);
+	//Reorders the records and their columns on the device by the key, statistics are unchanged.
+	void OrderBy(Records::SortKey);
+	//Covariance and correlation between every pair of stations, joined on the timestamp on the device. Requires columns.
+	CorrelationMatrix Correlation();
+	//Mergeable quantile sketch of the data in degrees with the given rank error, built on the device without a full sort.
+	QuantileSketch Sketch(double = 0.01);
+	//Approximate quantile (0-1) in degrees from a sketch that is kept until the data changes.
+	double Quantile(double, double = 0.01);
 private:
 	//Context parameters
 	int platform_ID = 0, device_ID = 0;
-	int local_size = 1024;
+	int local_size = 1024, items_per_work_item = 1;
 	cl::Context context;
-	cl::CommandQueue queue;
-	cl::Program program;
+	cl::CommandQueue queue, transfer_queue;
 	cl::Program::Sources sources;
-	cl::Buffer data_buffer, min_buffer, max_buffer, sum_buffer, std_buffer, sort_buffer;
+	//Program variants keyed by their build options and kernels keyed by options and name
+	std::map<std::string, cl::Program> programs;
+	std::map<std::string, cl::Kernel> kernels;
+	cl::Buffer data_buffer;
 	cl::NDRange local_range, global_range;
 	cl::Event prof_event;
 
+	//Record columns and the per record predicate flags of the last filter
+	cl::Buffer station_buffer, time_buffer, flags_buffer;
+	std::size_t flags_size = 0;
+	std::vector<std::string> station_names;
+	bool has_columns = false;
+
+	//Next dataset being uploaded on the transfer queue
+	cl::Buffer staged_buffer;
+	cl::Event staged_event;
+	std::vector<T> staged_data;
+	unsigned int staged_pad = 0;
+	bool has_staged = false;
+
+	//Sketch answering Quantile until the data changes
+	QuantileSketch sketch;
+	double sketch_epsilon = 0;
+	bool has_sketch = false;
+
 	//Statistic values
-	T neutral_value = 0, minimum = 0, maximum = 0, sum = 0, median = 0, first_quantile = 0, third_quantile = 0;
+	T neutral_value = 0, minimum = 0, maximum = 0, median = 0, first_quantile = 0, third_quantile = 0;
+	acc_t sum = 0;
 	float average = 0, std_deviation = 0;
+	//Statistic flags of the values above that are valid for the current data
+	unsigned int computed = 0;
 
 	//Class Flags
 	bool verbose = false, use_preferred = false, print_profiling_data = false, kernel_work_group_recursion = false;
 
 	//Data
-    std::vector<T> data, sorted_data;
+    std::vector<T> data;
 	unsigned int pad_right = 0;
+	Memory::Ledger memory;
+	//Scratch buffers (partials, sort output, keys, histograms) allocated on first use and recycled by size class
+	BufferPool pool{this->memory};
 
 	//Utility
 	std::string type = "";
+	//OpenCL C names and build options for T and its device accumulator, options shared by every variant
+	std::string device_type = "", acc_name = "", type_options = "", build_options = "";
+	//Multiplier from stored values to degrees (0.1 for tenths) and device accumulator width in bytes
+	float scale = 1.0f;
+	unsigned int acc_size = sizeof(acc_t);
     SimpleTimer timer;
 
 	void TypeCheck();
+	void TrackHostData();
+	//Shared implementation of the arg and top/bottom k kernels
+	WeatherRecord ArgExtreme(bool);
+	std::vector<WeatherRecord> SelectK(unsigned int, bool);
+	//Sorts (key, index) pairs padded to a power of two on the device, returns the pooled index buffer
+	cl::Buffer SortKeys(Records::SortKey);
+	//Resolves an index to its record, reading the station and timestamp columns if set
+	WeatherRecord LookupRecord(uint32_t, T);
+	//Allocates flags_buffer for the current data unless it already fits
+	void AllocateFlags();
+	//Evaluates the filter into flags_buffer and returns the value range in storage units
+	void EvaluateFilter(const Records::Filter &, T &, T &);
+	//Writes the workgroup positions and group offsets of the flagged records for compaction, returns the number flagged
+	cl_uint ScanFlags(const cl::Buffer &, const cl::Buffer &, const cl::Buffer &);
+	void ResetResults();
     void PrintProfilingData(const std::string &kernel_ID);
-	//Wrapper to enqueue kernels using the correct implementation from kernels.cl, manages automatic configuration of properties
-	void EnqueueKernel(cl::Kernel &, const std::string &, cl::Buffer &, int = 0);
+	//Wrapper to enqueue kernels from kernels.cl, manages printing of options and profiling
 	void EnqueueKernel(cl::Kernel &k, const std::string &ID);
-	void EnqueueNDRangeKernel(cl::Kernel &k, const std::string &kernel_ID);
-	//Utility function for kernel naming
-	std::string GetKernelName(std::string s, bool can_reduce = true);
+	void EnqueueNDRangeKernel(cl::Kernel &k, const std::string &kernel_ID, std::size_t global_size = 0);
+	void EnqueueNDRangeKernel(cl::Kernel &k, const std::string &kernel_ID, const cl::NDRange &global, const cl::NDRange &local);
+	//Build options of a kernel variant, optionally for a reduction operator (OP_MIN, OP_MAX, OP_SUM, OP_SUMSQ)
+	std::string KernelOptions(const std::string & = "", bool = false);
+	//Cached program variant and kernel lookup by name and build options (default variant when empty)
+	cl::Program &GetProgram(const std::string &);
+	cl::Kernel &GetKernel(const std::string &, const std::string & = "");
+	//Reduces the data with an operator into per workgroup partials, returns their pooled buffer (released by the caller) and count
+	cl::Buffer Reduce(const std::string &, unsigned int &, float = 0.0f);
+	//Reads the accumulator partials from the buffer and sums them on the host
+	acc_t ReduceAccumulatorPartials(cl::Buffer &, unsigned int);
+	//Reads the partials from the buffer and returns the smallest or largest
+	T ReduceExtremaPartials(cl::Buffer &, unsigned int, bool);
+	//Value of an order preserving key (inverse of value_key in kernels.cl)
+	static T KeyValue(uint32_t);
 };
 
 #endif
\ No newline at end of file
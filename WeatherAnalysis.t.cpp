@@ -5,20 +5,23 @@
 #include "WeatherAnalysis.hpp"
 #include "Utils.hpp"
 #include <algorithm>
+#include <limits>
+#include <cstring>
 
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "TemplateArgumentsIssues"
 
 //Fully Class Templated allowing easy configuration of data analysis options.
 
+//Takes ownership of the data, pass it with std::move so the class holds the only host copy
 template<class T>
-WeatherAnalysis<T>::WeatherAnalysis(std::vector<T> &t_data) {
+WeatherAnalysis<T>::WeatherAnalysis(std::vector<T> t_data) : data(std::move(t_data)) {
 	//Manually check and log template type name for kernel configuration
     this->TypeCheck();
 	//Set initial data variables/queue options
-    this->data = t_data;
     this->local_range = cl::NDRange(this->local_size);
-    this->global_range = cl::NDRange(t_data.size());
+    this->global_range = cl::NDRange(this->data.size());
+    this->TrackHostData();
 };
 
 //Parse command line arguments to configurable class options.
@@ -42,14 +45,16 @@ void WeatherAnalysis<T>::Initialise(const std::string cl_path) {
         std::cout << "Running on " << GetPlatformName(this->platform_ID) << ", "
                   << GetDeviceName(this->platform_ID, this->device_ID) << std::endl;
 
-        //Create a queue for kernels.
+        //Create a queue for kernels and a second queue so staged uploads overlap with kernel execution.
         this->queue = cl::CommandQueue(this->context, CL_QUEUE_PROFILING_ENABLE);
+        this->transfer_queue = cl::CommandQueue(this->context);
+        this->pool.Reset(this->context);
+        this->flags_size = 0;
 
         //Read file in and add to sources as pair (string*, length)
         AddSources(this->sources, cl_path);
-        this->program = cl::Program(this->context, this->sources);
 
-		//Build the program from source
+		//Detect the build options of the program
         this->Build();
     }
     catch (const cl::Error &e) {
@@ -62,21 +67,41 @@ void WeatherAnalysis<T>::Initialise(const std::string cl_path) {
 
 template<class T>
 void WeatherAnalysis<T>::Build() {
-    try {
-        program.build();
-    }
-    catch (const cl::Error &e) {
-		//Call utility function to avoid templating issues.
-        PrintBuildErrors(this->context, this->program);
-        throw std::exception();
+	//Accumulate floats in double on the device where supported, otherwise float partials are read back
+    this->build_options = "";
+    this->acc_name = std::numeric_limits<T>::is_integer ? "long" : "double";
+    this->acc_size = sizeof(acc_t);
+    std::string extensions = this->context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_EXTENSIONS>();
+    if (extensions.find("cl_khr_fp64") != std::string::npos) {
+        this->build_options = "-DWA_FP64";
+    } else if (!std::numeric_limits<T>::is_integer) {
+        this->acc_name = "float";
+        this->acc_size = sizeof(float);
     }
+
+	//Programs and kernels from a previous build are no longer valid, variants are built on first use
+	//once Configure has fixed the local size they are specialised for
+    this->programs.clear();
+    this->kernels.clear();
 };
 
 template<class T>
-void WeatherAnalysis<T>::Configure(int local_size, T neutral_value) {
-    this->local_size = local_size;
-    this->local_range = cl::NDRange(local_size);
+void WeatherAnalysis<T>::Configure(int local_size, T neutral_value, int items_per_work_item) {
+    if (local_size < 1)
+        throw std::runtime_error("ERROR: Local size must be at least 1.");
+
+	//Reductions, scans and sorts halve the workgroup every step so only power of two sizes are correct, other
+	//sizes (e.g. a preferred size of 768) are rounded down so the device limit still holds
+    int rounded = 1;
+    while (rounded <= local_size / 2)
+        rounded *= 2;
+    if (rounded != local_size)
+        std::cout << "Local size " << local_size << " rounded down to " << rounded << " (must be a power of two)" << std::endl;
+
+    this->local_size = rounded;
+    this->local_range = cl::NDRange(rounded);
     this->neutral_value = neutral_value;
+    this->items_per_work_item = std::max(1, items_per_work_item);
 };
 
 //Pads data by x elements so local_size is a factor of it to reduce into x groups.
@@ -84,19 +109,27 @@ template<class T>
 void WeatherAnalysis<T>::PadData(T neutral_value, bool print) {
 	//Calculate number of pad elements required and set neutral value 
 	// Neutral value is one that is inserted and ignored in the data.
-    unsigned int pad_count = this->data.size() % this->local_size;
     this->neutral_value = neutral_value;
 
+	//Kernels are specialised for the local size so the preferred size is chosen before the data is laid out
+    if (this->use_preferred)
+        this->Configure(GetPreferredWorkGroupSize(this->context, this->GetKernel("sort")), neutral_value, this->items_per_work_item);
+
+    unsigned int pad_count = this->data.size() % this->local_size;
+
     if (pad_count > 0) {
-        this->pad_right = pad_count;
-		//Insert neutral values at the end of the vector
-        std::vector<T> neutrals(this->local_size - this->pad_right, this->neutral_value);
-        this->data.insert(this->data.end(), neutrals.begin(), neutrals.end());
+		//Track the total number of inserted elements so statistics divide by the real element count
+        unsigned int pad_elements = this->local_size - pad_count;
+        this->pad_right += pad_elements;
+		//Insert neutral values at the end of the vector, growing it exactly rather than doubling its capacity
+        this->data.reserve(this->data.size() + pad_elements);
+        this->data.insert(this->data.end(), pad_elements, this->neutral_value);
+        this->TrackHostData();
 		
 		//Reconfigure global range to new size
         this->global_range = cl::NDRange(this->data.size());
         if (print)
-            std::cout << "Padded by " << this->pad_right << " elements of " << this->neutral_value << '\n' << std::endl;
+            std::cout << "Padded by " << pad_elements << " elements of " << this->neutral_value << '\n' << std::endl;
     } else {
         if (print)
             std::cout << "Data already a factor of local size\n" << std::endl;
@@ -105,18 +138,25 @@ void WeatherAnalysis<T>::PadData(T neutral_value, bool print) {
 
 template<class T>
 void WeatherAnalysis<T>::PrintResults() {
+	//Statistics are kept in storage units, GetResults scales them back to degrees
+    PrintResults(this->GetResults());
+};
+
+//Prints results in degrees without a device, e.g. from the result cache
+template<class T>
+void WeatherAnalysis<T>::PrintResults(const WeatherResults &r) {
 	//Use string stream to print correct precision and notation
     std::stringstream results;
     results.precision(5);
     results << "OpenCL Weather Analysis:" << "\n\t";
-    results << std::fixed << "Min: " << this->minimum << "\n\t";
-    results << std::fixed << "Max: " << this->maximum << "\n\t";
-    results << std::fixed << "Sum: " << this->sum << "\n\t";
-    results << std::fixed << "Average: " << this->average << "\n\t";
-	results << std::fixed << "Std Deviation: " << this->std_deviation << "\n\t";
-	results << std::fixed << "Median: " << this->median << "\n\t";
-	results << std::fixed << "First Quartile: " << this->first_quantile << "\n\t";
-    results << std::fixed << "Third Quartile: " << this->third_quantile << std::endl;
+    results << std::fixed << "Min: " << r.minimum << "\n\t";
+    results << std::fixed << "Max: " << r.maximum << "\n\t";
+    results << std::fixed << "Sum: " << r.sum << "\n\t";
+    results << std::fixed << "Average: " << r.average << "\n\t";
+	results << std::fixed << "Std Deviation: " << r.std_deviation << "\n\t";
+	results << std::fixed << "Median: " << r.median << "\n\t";
+	results << std::fixed << "First Quartile: " << r.first_quartile << "\n\t";
+    results << std::fixed << "Third Quartile: " << r.third_quartile << std::endl;
     std::cout << results.str();
 };
 
@@ -153,23 +193,22 @@ void WeatherAnalysis<T>::SetVerboseKernel(bool verbose) {
 
 template<class T>
 void WeatherAnalysis<T>::SetKernelWorkGroupRecursion(bool should_recurse) {
-	//Sets kernel recursion flag which determines if each kernel should be queued until the
-	//workgroup size reduces all of the elements min/max/sums to one single element
-    if (this->type == "FLOAT") {
-        this->kernel_work_group_recursion = should_recurse;
-    } else if (should_recurse){
-		//Dont allow for integers
-        std::cout << "No supported kernels for workgroup recursion for type " << this->type << std::endl;
-    }
+	//Sets kernel recursion flag which determines if the reduce kernel should be queued again over its own
+	//partials until the workgroups reduce all of the elements min/max/sums to one single element
+    this->kernel_work_group_recursion = should_recurse;
 };
 
 //Calculate and print some basic statistics sequentially
 template<class T>
 void WeatherAnalysis<T>::PrintBaselineResults() {
-    T smin = this->data[0], smax = 0, ssum = 0;
-    float savg = 0, sstd = 0;
-
-    for (auto val : this->data) {
+	//Ignore padded elements and accumulate in the wide type like the kernels
+    std::size_t count = this->data.size() - this->pad_right;
+    T smin = this->data[0], smax = this->data[0];
+    acc_t ssum = 0;
+    double savg = 0, sstd = 0;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        T val = this->data[i];
         if (val < smin)
             smin = val;
         else if (val > smax)
@@ -177,95 +216,361 @@ void WeatherAnalysis<T>::PrintBaselineResults() {
         ssum += val;
     }
 
-    savg = ssum / (float) (this->data.size() - this->pad_right);
+    savg = ssum / (double) count;
 
-    for (auto val: this->data) {
-        sstd += (val - savg) * (val - savg);
+    for (std::size_t i = 0; i < count; ++i) {
+        sstd += (this->data[i] - savg) * (this->data[i] - savg);
     }
 
-    sstd = sqrt(sstd / (float) (this->data.size() - this->pad_right));
+    sstd = sqrt(sstd / (double) count);
 
     std::stringstream results;
     results.precision(5);
     results << std::fixed << "OpenCL Weather Analysis - Baseline Results:" << "\n\t";
-    results << std::fixed << "Min: " << smin << "\n\t";
-    results << std::fixed << "Max: " << smax << "\n\t";
-    results << std::fixed << "Sum: " << ssum << "\n\t";
-    results << std::fixed << "Average: " << savg << "\n\t";
-    results << std::fixed << "Std Deviation: " << sstd << '\n' << std::endl;
+    results << std::fixed << "Min: " << smin * this->scale << "\n\t";
+    results << std::fixed << "Max: " << smax * this->scale << "\n\t";
+    results << std::fixed << "Sum: " << ssum * (double) this->scale << "\n\t";
+    results << std::fixed << "Average: " << savg * this->scale << "\n\t";
+    results << std::fixed << "Std Deviation: " << sstd * this->scale << '\n' << std::endl;
     std::cout << results.str();
 };
 
-//Write all buffers to the device, allow READ_WRITE for output buffers
+//Write the data to the device, result and scratch buffers come from the pool when a statistic first needs them
 template<class T>
 void WeatherAnalysis<T>::WriteDataToDevice() {
-	//Calculate byte size for each buffer, Use work group size of elements for 
-	// kernels that will reduce the workgroup down to a single element.
     unsigned int data_size = this->data.size() * sizeof(T);
-    unsigned int work_group_size = (this->data.size() / this->local_size) * sizeof(T);
 
     //Allocate device buffers
     this->data_buffer = cl::Buffer(this->context, CL_MEM_READ_ONLY, data_size);
     //Copy data_buffer data to device
     this->queue.enqueueWriteBuffer(this->data_buffer, CL_TRUE, 0, data_size, &this->data[0]);
+    this->memory.Track(Memory::DEVICE, "data", data_size);
+};
 
-    //Allocate device buffers
-    this->min_buffer = cl::Buffer(this->context, CL_MEM_READ_WRITE, work_group_size);
-    this->max_buffer = cl::Buffer(this->context, CL_MEM_READ_WRITE, work_group_size);
-    this->sum_buffer = cl::Buffer(this->context, CL_MEM_READ_WRITE, work_group_size);
-    this->std_buffer = cl::Buffer(this->context, CL_MEM_READ_WRITE, work_group_size);
-    this->sort_buffer = cl::Buffer(this->context, CL_MEM_READ_WRITE, data_size);
+//Reports the allocated size of the host data, padding may grow it and Select/SwapStagedData replace it
+template<class T>
+void WeatherAnalysis<T>::TrackHostData() {
+    this->memory.Track(Memory::HOST, "data", this->data.capacity() * sizeof(T));
+};
 
-    //Copy output buffer to device with all zeros in place
-    this->queue.enqueueFillBuffer(this->min_buffer, 0, 0, work_group_size);
-    this->queue.enqueueFillBuffer(this->max_buffer, 0, 0, work_group_size);
-    this->queue.enqueueFillBuffer(this->sum_buffer, 0, 0, work_group_size);
-    this->queue.enqueueFillBuffer(this->std_buffer, 0, 0, work_group_size);
-    this->queue.enqueueFillBuffer(this->sort_buffer, 0, 0, data_size);
+//Pads the next dataset and starts a non-blocking upload on the transfer queue.
+// Host data is held in staged_data until the upload completes, so the caller may carry on parsing/computing.
+template<class T>
+void WeatherAnalysis<T>::StageData(std::vector<T> next_data) {
+    this->staged_data = std::move(next_data);
+    this->has_staged = true;
+
+    unsigned int pad_count = this->staged_data.size() % this->local_size;
+    this->staged_pad = pad_count > 0 ? this->local_size - pad_count : 0;
+    this->staged_data.reserve(this->staged_data.size() + this->staged_pad);
+    this->staged_data.insert(this->staged_data.end(), this->staged_pad, this->neutral_value);
+    this->memory.Track(Memory::HOST, "staged", this->staged_data.capacity() * sizeof(T));
+
+    if (this->staged_data.empty())
+        return;
+
+    unsigned int data_size = this->staged_data.size() * sizeof(T);
+    this->staged_buffer = cl::Buffer(this->context, CL_MEM_READ_ONLY, data_size);
+    this->transfer_queue.enqueueWriteBuffer(this->staged_buffer, CL_FALSE, 0, data_size, &this->staged_data[0], NULL, &this->staged_event);
+    this->memory.Track(Memory::DEVICE, "staged", data_size);
+    this->transfer_queue.flush();
 };
 
-//Wrapper for EnqueueNDRangeKernel
+//Waits for the staged upload and makes it the current dataset, previous statistics are cleared.
 template<class T>
-void WeatherAnalysis<T>::EnqueueKernel(cl::Kernel &k, const std::string &ID) {
-    this->EnqueueNDRangeKernel(k, ID);
-}
+void WeatherAnalysis<T>::SwapStagedData() {
+    if (!this->has_staged)
+        throw std::runtime_error("ERROR: SwapStagedData called without staged data.");
+
+    if (!this->staged_data.empty())
+        this->staged_event.wait();
+
+	//Release the previous dataset rather than keeping its capacity around in staged_data
+    this->data = std::move(this->staged_data);
+    std::vector<T>().swap(this->staged_data);
+    this->data_buffer = this->staged_buffer;
+    this->staged_buffer = cl::Buffer();
+    this->has_columns = false;
+    this->pad_right = this->staged_pad;
+    this->global_range = cl::NDRange(this->data.size());
+    this->has_staged = false;
+
+    this->TrackHostData();
+    this->memory.Track(Memory::HOST, "staged", 0);
+    this->memory.Track(Memory::DEVICE, "data", this->data.size() * sizeof(T));
+    this->memory.Track(Memory::DEVICE, "staged", 0);
+
+    this->ResetResults();
+};
 
-//Configures options for autoatically reducing appropriate kernels
-template<class T>
-void WeatherAnalysis<T>::EnqueueKernel(cl::Kernel &k, const std::string &ID, cl::Buffer &out_buffer, int in_index) {
-    if (this->kernel_work_group_recursion) {
-        std::cout << "Calling '" << ID << "' recursively until work group output reduced to one element\n" << std::endl;
-		//Calculate initial number of work groups
-        int work_group_count = this->data.size() / this->local_size;
-        bool swapped = false;
-
-		//While the number of work groups does relate to a reduction to a single element
-        while (work_group_count > this->local_size) {
-            this->EnqueueNDRangeKernel(k, ID);
-
-			//Copy the output buffer to the input buffer once, then decrement wgs.
-            if (swapped) {
-                work_group_count /= this->local_size;
-            } else {
-                k.setArg(in_index, out_buffer);
-                swapped = true;
-            }
-        }
+template<class T>
+void WeatherAnalysis<T>::SetColumns(Records::Columns columns) {
+    if (columns.stations.size() != this->data.size() - this->pad_right || columns.timestamps.size() != columns.stations.size())
+        throw std::runtime_error("ERROR: Record columns do not match the size of the data.");
+
+	//Only the names stay on the host, the id and timestamp columns are released once uploaded
+    this->station_names.swap(columns.station_names);
+    std::size_t name_bytes = this->station_names.capacity() * sizeof(std::string);
+    for (auto const &name : this->station_names)
+        name_bytes += name.capacity();
+    this->memory.Track(Memory::HOST, "names", name_bytes);
+    Memory::Scoped column_memory(this->memory, Memory::HOST, "columns",
+                                 columns.stations.capacity() * sizeof(uint16_t) + columns.timestamps.capacity() * sizeof(uint32_t));
+
+	//Pad the columns like the data on the device, padded records are excluded by the count in the predicate
+    std::size_t count = columns.stations.size(), padded = this->data.size();
+    this->station_buffer = cl::Buffer(this->context, CL_MEM_READ_WRITE, padded * sizeof(uint16_t));
+    this->time_buffer = cl::Buffer(this->context, CL_MEM_READ_WRITE, padded * sizeof(uint32_t));
+    this->queue.enqueueFillBuffer(this->station_buffer, (uint16_t) 0, 0, padded * sizeof(uint16_t));
+    this->queue.enqueueFillBuffer(this->time_buffer, (uint32_t) 0, 0, padded * sizeof(uint32_t));
+    if (count > 0) {
+        this->queue.enqueueWriteBuffer(this->station_buffer, CL_TRUE, 0, count * sizeof(uint16_t), &columns.stations[0]);
+        this->queue.enqueueWriteBuffer(this->time_buffer, CL_TRUE, 0, count * sizeof(uint32_t), &columns.timestamps[0]);
+    }
+    this->has_columns = true;
+
+    this->memory.Track(Memory::DEVICE, "stations", padded * sizeof(uint16_t));
+    this->memory.Track(Memory::DEVICE, "times", padded * sizeof(uint32_t));
+};
+
+//The flags are rewritten by every filter, a buffer is only allocated when the data size changes
+template<class T>
+void WeatherAnalysis<T>::AllocateFlags() {
+    if (this->flags_size == this->data.size())
+        return;
+    this->flags_buffer = cl::Buffer(this->context, CL_MEM_READ_WRITE, this->data.size());
+    this->flags_size = this->data.size();
+    this->memory.Track(Memory::DEVICE, "flags", this->flags_size);
+};
+
+template<class T>
+void WeatherAnalysis<T>::EvaluateFilter(const Records::Filter &filter, T &low, T &high) {
+    if (!this->has_columns)
+        throw std::runtime_error("ERROR: Filtering requires record columns, call SetColumns first.");
+
+	//Byte mask of the stations to keep indexed by station id, unknown names match nothing
+    std::vector<cl_uchar> mask(std::max<std::size_t>(1, this->station_names.size()), filter.stations.empty() ? 1 : 0);
+    for (auto const &name : filter.stations) {
+        auto found = std::find(this->station_names.begin(), this->station_names.end(), name);
+        if (found != this->station_names.end())
+            mask[found - this->station_names.begin()] = 1;
+    }
+    cl::Buffer mask_buffer(this->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, mask.size(), &mask[0]);
+
+	//Convert the value range from degrees to storage units, rounding inwards for integer types
+    double lowest = std::numeric_limits<T>::lowest(), highest = std::numeric_limits<T>::max();
+    double value_min = std::max(lowest, filter.value_min / this->scale);
+    double value_max = std::min(highest, filter.value_max / this->scale);
+    if (std::numeric_limits<T>::is_integer) {
+        value_min = std::ceil(value_min - 1e-6);
+        value_max = std::floor(value_max + 1e-6);
+    }
+    low = (T) value_min;
+    high = (T) value_max;
+
+    std::string kernel_ID("filter_flags");
+    this->AllocateFlags();
+
+    cl::Kernel &flags_kernel = this->GetKernel(kernel_ID);
+    flags_kernel.setArg(0, this->data_buffer);
+    flags_kernel.setArg(1, this->station_buffer);
+    flags_kernel.setArg(2, this->time_buffer);
+    flags_kernel.setArg(3, mask_buffer);
+    flags_kernel.setArg(4, (cl_uint) (this->data.size() - this->pad_right));
+    flags_kernel.setArg(5, (cl_uint) filter.time_from);
+    flags_kernel.setArg(6, (cl_uint) filter.time_to);
+    flags_kernel.setArg(7, (cl_uint) filter.hour_from);
+    flags_kernel.setArg(8, (cl_uint) filter.hour_to);
+    flags_kernel.setArg(9, low);
+    flags_kernel.setArg(10, high);
+    flags_kernel.setArg(11, this->flags_buffer);
+
+    this->EnqueueKernel(flags_kernel, kernel_ID);
+};
+
+template<class T>
+WeatherResults WeatherAnalysis<T>::FilteredStatistics(const Records::Filter &filter) {
+    T low, high;
+    this->EvaluateFilter(filter, low, high);
+
+    unsigned int group_count = this->data.size() / this->local_size;
+    BufferPool::Lease mins(this->pool, group_count * sizeof(T));
+    BufferPool::Lease maxs(this->pool, group_count * sizeof(T));
+    BufferPool::Lease counts(this->pool, group_count * sizeof(cl_uint));
+    BufferPool::Lease sums(this->pool, group_count * sizeof(acc_t));
+    BufferPool::Lease squares(this->pool, group_count * sizeof(acc_t));
+
+	//Floats are shifted like Moments, by the average when known, integer squares are exact
+    float shift = 0.0f;
+    if (!std::numeric_limits<T>::is_integer)
+        shift = (this->computed & STAT_SUM) ? this->average : (float) this->data[0];
+
+	//Fused moments of the matching records, one partial of each per workgroup
+    std::string kernel_ID("filter_stats");
+    cl::Kernel &stats_kernel = this->GetKernel(kernel_ID);
+    stats_kernel.setArg(0, this->data_buffer);
+    stats_kernel.setArg(1, this->flags_buffer);
+    stats_kernel.setArg(2, low);
+    stats_kernel.setArg(3, high);
+    stats_kernel.setArg(4, shift);
+    stats_kernel.setArg(5, mins.buffer);
+    stats_kernel.setArg(6, maxs.buffer);
+    stats_kernel.setArg(7, counts.buffer);
+    stats_kernel.setArg(8, sums.buffer);
+    stats_kernel.setArg(9, squares.buffer);
+    stats_kernel.setArg(10, cl::Local(this->local_size * sizeof(T)));
+    stats_kernel.setArg(11, cl::Local(this->local_size * sizeof(T)));
+    stats_kernel.setArg(12, cl::Local(this->local_size * sizeof(cl_uint)));
+    stats_kernel.setArg(13, cl::Local(this->local_size * this->acc_size));
+    stats_kernel.setArg(14, cl::Local(this->local_size * this->acc_size));
+
+    this->EnqueueKernel(stats_kernel, kernel_ID);
+
+    std::vector<T> group_mins(group_count), group_maxs(group_count);
+    std::vector<cl_uint> group_counts(group_count);
+    this->queue.enqueueReadBuffer(mins.buffer, CL_TRUE, 0, group_count * sizeof(T), &group_mins[0]);
+    this->queue.enqueueReadBuffer(maxs.buffer, CL_TRUE, 0, group_count * sizeof(T), &group_maxs[0]);
+    this->queue.enqueueReadBuffer(counts.buffer, CL_TRUE, 0, group_count * sizeof(cl_uint), &group_counts[0]);
+
+    WeatherResults results = WeatherResults();
+    T minimum = high, maximum = low;
+    for (unsigned int i = 0; i < group_count; ++i) {
+        if (group_counts[i] == 0)
+            continue;
+        minimum = std::min(minimum, group_mins[i]);
+        maximum = std::max(maximum, group_maxs[i]);
+        results.count += group_counts[i];
+    }
+
+    if (results.count == 0)
+        return results;
+
+    acc_t sum = this->ReduceAccumulatorPartials(sums.buffer, group_count);
+    acc_t sum_squares = this->ReduceAccumulatorPartials(squares.buffer, group_count);
+    long double shifted_sum = (long double) sum - (long double) shift * results.count;
+    long double variance = (sum_squares - shifted_sum * shifted_sum / results.count) / results.count;
+
+    results.minimum = minimum * this->scale;
+    results.maximum = maximum * this->scale;
+    results.sum = sum * (double) this->scale;
+    results.average = results.sum / results.count;
+    results.std_deviation = (double) sqrt(variance > 0 ? variance : 0) * this->scale;
+    results.statistics = STAT_MIN | STAT_MAX | STAT_SUM | STAT_STD;
+    return results;
+};
+
+//Position of every flagged record within its workgroup, then an exclusive scan of the (few) group totals on the host
+//gives the output offset of every group. Returns the number of flagged records.
+template<class T>
+cl_uint WeatherAnalysis<T>::ScanFlags(const cl::Buffer &flags, const cl::Buffer &positions, const cl::Buffer &offsets_buffer) {
+    unsigned int group_count = this->data.size() / this->local_size;
+    BufferPool::Lease counts(this->pool, group_count * sizeof(cl_uint));
+
+    std::string scan_ID("filter_scan");
+    cl::Kernel &scan_kernel = this->GetKernel(scan_ID);
+    scan_kernel.setArg(0, flags);
+    scan_kernel.setArg(1, positions);
+    scan_kernel.setArg(2, counts.buffer);
+    scan_kernel.setArg(3, cl::Local(this->local_size * sizeof(cl_uint)));
+    this->EnqueueKernel(scan_kernel, scan_ID);
+
+    std::vector<cl_uint> offsets(group_count);
+    this->queue.enqueueReadBuffer(counts.buffer, CL_TRUE, 0, group_count * sizeof(cl_uint), &offsets[0]);
+    cl_uint total = 0;
+    for (auto &offset : offsets) {
+        cl_uint group_total = offset;
+        offset = total;
+        total += group_total;
+    }
+    this->queue.enqueueWriteBuffer(offsets_buffer, CL_TRUE, 0, group_count * sizeof(cl_uint), &offsets[0]);
+    return total;
+};
+
+template<class T>
+void WeatherAnalysis<T>::Select(const Records::Filter &filter) {
+    T low, high;
+    this->EvaluateFilter(filter, low, high);
+
+    BufferPool::Lease positions(this->pool, this->data.size() * sizeof(cl_uint));
+    BufferPool::Lease offsets(this->pool, this->data.size() / this->local_size * sizeof(cl_uint));
+    cl_uint total = this->ScanFlags(this->flags_buffer, positions.buffer, offsets.buffer);
+    if (total == 0)
+        throw std::runtime_error("ERROR: No records match the filter, dataset left unchanged.");
+
+	//Pad the subset with one of its own values which is neutral for min/max and removed from sum/std
+    unsigned int pad_count = total % this->local_size;
+    unsigned int pad_elements = pad_count > 0 ? this->local_size - pad_count : 0;
+    unsigned int padded = total + pad_elements;
+    T first_value = 0;
+
+	//Compacted into pooled buffers then copied back, the subset is never larger than the data and column buffers
+    BufferPool::Lease out(this->pool, padded * sizeof(T));
+    BufferPool::Lease out_stations(this->pool, padded * sizeof(uint16_t));
+    BufferPool::Lease out_times(this->pool, padded * sizeof(uint32_t));
+    this->queue.enqueueFillBuffer(out_stations.buffer, (uint16_t) 0, 0, padded * sizeof(uint16_t));
+    this->queue.enqueueFillBuffer(out_times.buffer, (uint32_t) 0, 0, padded * sizeof(uint32_t));
+
+    std::string compact_ID("compact");
+    cl::Kernel &compact_kernel = this->GetKernel(compact_ID);
+    compact_kernel.setArg(0, this->data_buffer);
+    compact_kernel.setArg(1, this->station_buffer);
+    compact_kernel.setArg(2, this->time_buffer);
+    compact_kernel.setArg(3, this->flags_buffer);
+    compact_kernel.setArg(4, positions.buffer);
+    compact_kernel.setArg(5, offsets.buffer);
+    compact_kernel.setArg(6, out.buffer);
+    compact_kernel.setArg(7, out_stations.buffer);
+    compact_kernel.setArg(8, out_times.buffer);
+    this->EnqueueKernel(compact_kernel, compact_ID);
+
+    this->queue.enqueueReadBuffer(out.buffer, CL_TRUE, 0, sizeof(T), &first_value);
+    if (pad_elements > 0)
+        this->queue.enqueueFillBuffer(out.buffer, first_value, total * sizeof(T), pad_elements * sizeof(T));
+    this->queue.enqueueCopyBuffer(out.buffer, this->data_buffer, 0, 0, padded * sizeof(T));
+    this->queue.enqueueCopyBuffer(out_stations.buffer, this->station_buffer, 0, 0, padded * sizeof(uint16_t));
+    this->queue.enqueueCopyBuffer(out_times.buffer, this->time_buffer, 0, 0, padded * sizeof(uint32_t));
+
+	//Keep the host copy in step with the compacted subset, the previous dataset is released
+    {
+        Memory::Scoped subset_memory(this->memory, Memory::HOST, "subset", padded * sizeof(T));
+        std::vector<T> subset(padded);
+        this->queue.enqueueReadBuffer(out.buffer, CL_TRUE, 0, padded * sizeof(T), &subset[0]);
+        this->data.swap(subset);
     }
+    this->TrackHostData();
+
+    this->neutral_value = first_value;
+    this->pad_right = pad_elements;
+    this->global_range = cl::NDRange(padded);
 
-	//Call the kernel one last time in either case to get the last reduced value
+    this->ResetResults();
+};
+
+template<class T>
+void WeatherAnalysis<T>::ResetResults() {
+    this->minimum = this->maximum = this->median = this->first_quantile = this->third_quantile = 0;
+    this->sum = 0;
+    this->average = this->std_deviation = 0;
+    this->computed = 0;
+    this->has_sketch = false;
+};
+
+//Wrapper for EnqueueNDRangeKernel
+template<class T>
+void WeatherAnalysis<T>::EnqueueKernel(cl::Kernel &k, const std::string &ID) {
     this->EnqueueNDRangeKernel(k, ID);
 }
 
 template<class T>
-void WeatherAnalysis<T>::EnqueueNDRangeKernel(cl::Kernel &k, const std::string &kernel_ID) {
-	//If flag set configure preferred options determined by the kernel
-    if (this->use_preferred) {
-        this->Configure(GetPreferredWorkGroupSize(this->context, k), this->neutral_value);
-		//Reconfigure padding and local/global sizes
-        this->PadData(this->neutral_value, false);
-    }
+void WeatherAnalysis<T>::EnqueueNDRangeKernel(cl::Kernel &k, const std::string &kernel_ID, std::size_t global_size) {
+	//Kernels over intermediate buffers pass their own global size
+    cl::NDRange global = global_size > 0 ? cl::NDRange(global_size) : this->global_range;
+    this->EnqueueNDRangeKernel(k, kernel_ID, global, this->local_range);
+};
 
+//Multi-dimensional kernels pass both ranges
+template<class T>
+void WeatherAnalysis<T>::EnqueueNDRangeKernel(cl::Kernel &k, const std::string &kernel_ID, const cl::NDRange &global, const cl::NDRange &local) {
     if (this->verbose)
         this->PrintQueueOptions(k);
 
@@ -273,141 +578,254 @@ void WeatherAnalysis<T>::EnqueueNDRangeKernel(cl::Kernel &k, const std::string &
     this->timer.Tic();
 
     //Queue and execute kernel
-    this->queue.enqueueNDRangeKernel(k, cl::NullRange, this->global_range, this->local_range, NULL, &this->prof_event);
+    this->queue.enqueueNDRangeKernel(k, cl::NullRange, global, local, NULL, &this->prof_event);
 
 	//print execution statistics from the kernel
     if (this->print_profiling_data)
         this->PrintProfilingData(kernel_ID);
 };
 
-//Utility function to configure kernel names based on templated type and options
+//Build options specialising kernels.cl for T and the current local size. Reductions add their operator, and
+//partials = true reduces accumulator partials (TYPE is the accumulator) for workgroup recursion.
 template<class T>
-std::string WeatherAnalysis<T>::GetKernelName(std::string s, bool can_reduce) {
-    return s + ((can_reduce && this->kernel_work_group_recursion) ? "_WG_REDUCE_" : "_") + this->type;
+std::string WeatherAnalysis<T>::KernelOptions(const std::string &op, bool partials) {
+    bool extrema = op == "OP_MIN" || op == "OP_MAX";
+    std::string element = partials ? this->acc_name : this->device_type;
+
+    std::stringstream options;
+    options << this->build_options << " -DTYPE=" << element << " -DACC=" << (extrema ? element : this->acc_name)
+            << " -DLOCAL_SIZE=" << this->local_size << " -DITEMS=" << this->items_per_work_item;
+    if (!partials)
+        options << ' ' << this->type_options;
+    if (!op.empty())
+        options << " -DOP=" << op;
+    return options.str();
 }
 
+//Returns the program built with the options, building it on first use. Each distinct set of options is one variant.
 template<class T>
-void WeatherAnalysis<T>::Min() {
-    std::string kernel_ID(this->GetKernelName("min"));
+cl::Program &WeatherAnalysis<T>::GetProgram(const std::string &options) {
+    auto cached = this->programs.find(options);
+    if (cached == this->programs.end()) {
+        cl::Program program(this->context, this->sources);
+        try {
+            program.build(options.c_str());
+        }
+        catch (const cl::Error &e) {
+			//Call utility function to avoid templating issues.
+            PrintBuildErrors(this->context, program);
+            throw std::exception();
+        }
+        cached = this->programs.insert(std::make_pair(options, program)).first;
+    }
+    return cached->second;
+}
 
-    //Configure kernels and queue them for execution
-    //Allocate local memory with number of local elements * size
-    cl::Kernel min_kernel = cl::Kernel(program, kernel_ID.c_str());
-    min_kernel.setArg(0, this->data_buffer);
-    min_kernel.setArg(1, this->min_buffer);
-    min_kernel.setArg(2, cl::Local(this->local_size * sizeof(T)));
+//Returns the kernel from the cache, creating it on first use so repeated queries skip kernel creation.
+//Kernels come from the default variant unless build options are given.
+template<class T>
+cl::Kernel &WeatherAnalysis<T>::GetKernel(const std::string &kernel_ID, const std::string &options) {
+    std::string variant = options.empty() ? this->KernelOptions() : options;
+    std::string key = variant + ' ' + kernel_ID;
+
+    auto cached = this->kernels.find(key);
+    if (cached == this->kernels.end())
+        cached = this->kernels.insert(std::make_pair(key, cl::Kernel(this->GetProgram(variant), kernel_ID.c_str()))).first;
+    return cached->second;
+}
 
-	//Queue and execute the kernel
-    this->EnqueueKernel(min_kernel, kernel_ID, this->min_buffer);
+template<class T>
+WeatherResults WeatherAnalysis<T>::GetResults() const {
+    WeatherResults results;
+    results.count = this->data.size() - this->pad_right;
+    results.minimum = this->minimum * this->scale;
+    results.maximum = this->maximum * this->scale;
+    results.sum = this->sum * (double) this->scale;
+    results.average = this->average * this->scale;
+    results.std_deviation = this->std_deviation * this->scale;
+    results.median = this->median * this->scale;
+    results.first_quartile = this->first_quantile * this->scale;
+    results.third_quartile = this->third_quantile * this->scale;
+    results.statistics = this->computed;
+    return results;
+}
 
-    //Create vector to read final values to
-    std::vector<T> output(this->data.size(), 0);
+//Queues the reduce kernel for the operator over the data, partials receives one result per workgroup.
+//With workgroup recursion the partials are reduced again on the device until a single one is left.
+//Returns the pooled buffer holding the final partials, which the caller releases, and sets their count.
+template<class T>
+cl::Buffer WeatherAnalysis<T>::Reduce(const std::string &op, unsigned int &group_count, float shift) {
+    bool extrema = op == "OP_MIN" || op == "OP_MAX";
+    unsigned int width = extrema ? sizeof(T) : this->acc_size;
+    unsigned int span = this->local_size * this->items_per_work_item;
+	//Padding is left out so every plan reduces the same records, the kernel loads the identity past n
+    cl_uint count = this->data.size() - this->pad_right;
+    group_count = std::max<cl_uint>(1, (count + span - 1) / span);
+    cl::Buffer partials = this->pool.Acquire(group_count * width);
+
+    cl::Kernel &reduce_kernel = this->GetKernel("reduce", this->KernelOptions(op));
+    reduce_kernel.setArg(0, this->data_buffer);
+    reduce_kernel.setArg(1, count);
+    reduce_kernel.setArg(2, partials);
+    reduce_kernel.setArg(3, shift);
+    reduce_kernel.setArg(4, cl::Local(this->local_size * width));
+    this->EnqueueNDRangeKernel(reduce_kernel, op, group_count * this->local_size);
+
+    cl::Buffer input = partials;
+    if (!this->kernel_work_group_recursion)
+        return input;
+
+	//Sums of squares are added like sums once the squares are taken
+    cl::Kernel &partials_kernel = this->GetKernel("reduce", this->KernelOptions(extrema ? op : "OP_SUM", !extrema));
+    while (group_count > 1) {
+        count = group_count;
+        group_count = (count + span - 1) / span;
+        cl::Buffer output = this->pool.Acquire(group_count * width);
+
+        partials_kernel.setArg(0, input);
+        partials_kernel.setArg(1, count);
+        partials_kernel.setArg(2, output);
+        partials_kernel.setArg(3, 0.0f);
+        partials_kernel.setArg(4, cl::Local(this->local_size * width));
+        this->EnqueueNDRangeKernel(partials_kernel, op, group_count * this->local_size);
+
+        this->pool.Release(input);
+        input = output;
+    }
 
-    //Copy the result from the device 
-    this->queue.enqueueReadBuffer(this->min_buffer, CL_TRUE, 0, sizeof(T), &output[0]);
+    return input;
+}
 
-    this->minimum = output.at(0);
-};
+template<class T>
+typename WeatherAnalysis<T>::acc_t WeatherAnalysis<T>::ReduceAccumulatorPartials(cl::Buffer &buffer, unsigned int group_count) {
+    acc_t total = 0;
+
+	//Device may accumulate floats in single precision, read those back at their own width
+    if (this->acc_size == sizeof(acc_t)) {
+        std::vector<acc_t> partials(group_count, 0);
+        this->queue.enqueueReadBuffer(buffer, CL_TRUE, 0, group_count * sizeof(acc_t), &partials[0]);
+        for (auto partial : partials)
+            total += partial;
+    } else {
+        std::vector<float> partials(group_count, 0);
+        this->queue.enqueueReadBuffer(buffer, CL_TRUE, 0, group_count * sizeof(float), &partials[0]);
+        for (auto partial : partials)
+            total += partial;
+    }
+
+    return total;
+}
 
 template<class T>
-void WeatherAnalysis<T>::Max() {
-    std::string kernel_ID(this->GetKernelName("max"));
+T WeatherAnalysis<T>::KeyValue(uint32_t key) {
+    if (std::numeric_limits<T>::is_integer)
+        return (T) (int32_t) (key ^ 0x80000000u);
+
+    uint32_t bits = (key & 0x80000000u) ? key ^ 0x80000000u : ~key;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return (T) value;
+}
 
-    //Configure kernels and queue them for execution
-    //Allocate local memory with number of local elements * size
-    cl::Kernel max_kernel = cl::Kernel(program, kernel_ID.c_str());
-    max_kernel.setArg(0, this->data_buffer);
-    max_kernel.setArg(1, this->max_buffer);
-    max_kernel.setArg(2, cl::Local(this->local_size * sizeof(T)));
+template<class T>
+T WeatherAnalysis<T>::ReduceExtremaPartials(cl::Buffer &buffer, unsigned int group_count, bool find_max) {
+    std::vector<T> partials(group_count, 0);
 
-    this->EnqueueKernel(max_kernel, kernel_ID, this->max_buffer);
+    this->queue.enqueueReadBuffer(buffer, CL_TRUE, 0, group_count * sizeof(T), &partials[0]);
 
-    //Create vector to read final values to
-    std::vector<T> output(this->data.size(), 0);
+    return find_max ? *std::max_element(partials.begin(), partials.end())
+                    : *std::min_element(partials.begin(), partials.end());
+}
 
-    //Copy the result from device to host
-    this->queue.enqueueReadBuffer(this->max_buffer, CL_TRUE, 0, sizeof(T), &output[0]);
+template<class T>
+void WeatherAnalysis<T>::Min() {
+	//One partial per workgroup (or one in total with recursion), the host finishes the reduction
+    unsigned int group_count = 0;
+    BufferPool::Lease partials(this->pool, this->Reduce("OP_MIN", group_count));
+
+    this->minimum = this->ReduceExtremaPartials(partials.buffer, group_count, false);
+    this->computed |= STAT_MIN;
+};
+
+template<class T>
+void WeatherAnalysis<T>::Max() {
+    unsigned int group_count = 0;
+    BufferPool::Lease partials(this->pool, this->Reduce("OP_MAX", group_count));
 
-    this->maximum = output.at(0);
+    this->maximum = this->ReduceExtremaPartials(partials.buffer, group_count, true);
+    this->computed |= STAT_MAX;
 };
 
 //Calculate average sequentially as it isn't worth doing in parallel as sum is required anyway.
 template<class T>
 void WeatherAnalysis<T>::Average() {
-    if (this->sum == 0)
+    if (!(this->computed & STAT_SUM))
         this->Sum();
 };
 
 template<class T>
 void WeatherAnalysis<T>::Sum() {
-    std::string kernel_ID(this->GetKernelName("sum"));
-
-    //Configure kernels and queue them for execution
-    cl::Kernel sum_kernel = cl::Kernel(program, kernel_ID.c_str());
-    sum_kernel.setArg(0, this->data_buffer);
-    sum_kernel.setArg(1, this->sum_buffer);
+    unsigned int group_count = 0;
+    BufferPool::Lease partials(this->pool, this->Reduce("OP_SUM", group_count));
 
-    //Allocate local memory with number of local elements * size
-    sum_kernel.setArg(2, cl::Local(this->local_size * sizeof(T)));
-
-    this->EnqueueKernel(sum_kernel, kernel_ID, this->sum_buffer);
-
-    //Create vector to read final values to
-    std::vector<T> output(this->data.size(), 0);
-
-    //Copy the result from device to host
-    this->queue.enqueueReadBuffer(this->sum_buffer, CL_TRUE, 0, sizeof(T), &output[0]);
+	//Add the wide partials of each workgroup
+    this->sum = this->ReduceAccumulatorPartials(partials.buffer, group_count);
 
 	//Calculate average too (see comment on Average function)
-    this->sum = output.at(0);
-	this->average = (float) this->sum / (float)(this->data.size() - this->pad_right);
+	this->average = (float) ((double) this->sum / (double)(this->data.size() - this->pad_right));
+    this->computed |= STAT_SUM;
 };
 
 template<class T>
 void WeatherAnalysis<T>::StdDeviation() {
-    std::string kernel_ID(this->GetKernelName("std", false));
+    std::size_t count = this->data.size() - this->pad_right;
+    bool integer = std::numeric_limits<T>::is_integer;
 
-    //Configure kernels and queue them for execution
-    cl::Kernel std_kernel = cl::Kernel(this->program, kernel_ID.c_str());
-    std_kernel.setArg(0, this->data_buffer);
-    std_kernel.setArg(1, this->std_buffer);
-    std_kernel.setArg(2, this->average);
+	//Both variants depend on the sum (and the average derived from it)
+    if (!(this->computed & STAT_SUM))
+        this->Sum();
 
-    //Allocate local memory with number of local elements * size
-    std_kernel.setArg(3, cl::Local(this->local_size * sizeof(T)));
+	//Float kernels sum squared differences from the mean, integer kernels sum squares exactly
+    unsigned int group_count = 0;
+    BufferPool::Lease partials(this->pool, this->Reduce("OP_SUMSQ", group_count, integer ? 0.0f : this->average));
 
-    this->EnqueueKernel(std_kernel, kernel_ID);
+    acc_t total = this->ReduceAccumulatorPartials(partials.buffer, group_count);
+    long double variance = 0;
 
-    //Create vector to read final values
-    std::vector<T> output(this->data.size(), 0);
+	//Population variance on the host
+    if (!integer)
+        variance = total / (long double) count;
+    else
+        variance = (total - (long double) this->sum * this->sum / count) / count;
 
-    //Copy the result from device to host
-    this->queue.enqueueReadBuffer(this->std_buffer, CL_TRUE, 0, sizeof(T), &output[0]);
-	
-	//Dependant on executed kernel calculate the Standard deviation of sum of differences on the host or used returned value
-    this->std_deviation = this->type == "INT" ? sqrt((float)output.at(0) / (float)(this->data.size() - this->pad_right)) : output.at(0);
+    this->std_deviation = (float) sqrt(variance > 0 ? variance : 0);
+    this->computed |= STAT_STD;
 };
 
 //Sort kernel - Will call the kernel until a sorted data set is obtained
 template<class T>
 void WeatherAnalysis<T>::Sort() {
-    std::string kernel_ID("sort_" + this->type);
+    std::string kernel_ID("sort");
 	//Flag to specify what position data will be transfered from global to local on the kernel
 	int merge = 0; 
 
+	//Output buffer is only held while sorting, every element is written by the first pass
+    BufferPool::Lease sort_buffer(this->pool, this->data.size() * sizeof(T));
+
     //Configure kernels and queue them for execution
-    cl::Kernel sort_kernel = cl::Kernel(this->program, kernel_ID.c_str());
+    cl::Kernel &sort_kernel = this->GetKernel(kernel_ID);
     sort_kernel.setArg(0, this->data_buffer);
-    sort_kernel.setArg(1, this->sort_buffer);
+    sort_kernel.setArg(1, sort_buffer.buffer);
     sort_kernel.setArg(2, cl::Local(this->local_size * sizeof(T)));
     sort_kernel.setArg(3, merge);
 
-    //Create vector to read final values
+    //Create vector to read final values, the only host scratch the size of the data and released on return
     std::vector<T> output(this->data.size(), 0);
+    Memory::Scoped sort_memory(this->memory, Memory::HOST, "sort", output.size() * sizeof(T));
 
 	//Initially call the kernel so that the input buffer can be replaced with the modified/sorted data
     this->EnqueueKernel(sort_kernel, kernel_ID);
-    sort_kernel.setArg(0, this->sort_buffer);
+    sort_kernel.setArg(0, sort_buffer.buffer);
 
     do {
 		//Flip the merge flag and set it
@@ -419,15 +837,722 @@ void WeatherAnalysis<T>::Sort() {
 
 		//Read the buffer and wait for it to finish then check if the kernel is sorted
 		//If not, repeat from top of the loop
-        this->queue.enqueueReadBuffer(this->sort_buffer, CL_TRUE, 0, this->data.size() * sizeof(T), &output[0]);
+        this->queue.enqueueReadBuffer(sort_buffer.buffer, CL_TRUE, 0, this->data.size() * sizeof(T), &output[0]);
         this->queue.finish();
     } while (!std::is_sorted(output.begin(), output.end()));
 
 	//Calculate all dependant values of sort here as it's an array index only
-	this->sorted_data = output;
-	this->median = this->sorted_data[round(output.size() * 0.5)];
-	this->first_quantile = this->sorted_data[round(output.size() * 0.25)];
-	this->third_quantile = this->sorted_data[round(output.size() * 0.75)];
+	this->median = output[round(output.size() * 0.5)];
+	this->first_quantile = output[round(output.size() * 0.25)];
+	this->third_quantile = output[round(output.size() * 0.75)];
+    this->computed |= STAT_QUARTILES;
+};
+
+//Plans the passes for the missing statistics, each plan costs at most one pass for the moments and four for quartiles
+template<class T>
+WeatherResults WeatherAnalysis<T>::Query(unsigned int statistics) {
+    unsigned int missing = statistics & ~this->computed;
+    unsigned int moments = missing & (STAT_MIN | STAT_MAX | STAT_SUM | STAT_STD);
+
+	//A lone moment is a single reduction, the standard deviation alone also reuses a cached sum
+    bool single = moments == STAT_MIN || moments == STAT_MAX || moments == STAT_SUM || (moments == STAT_STD && (this->computed & STAT_SUM));
+    if (this->verbose)
+        std::cout << "Query plan: " << (moments == 0 ? "cached moments" : single ? "single reduction" : "fused moments")
+                  << ", " << (missing & STAT_QUARTILES ? "histogram quartiles" : "no quartiles") << std::endl;
+
+    if (moments == STAT_MIN)
+        this->Min();
+    else if (moments == STAT_MAX)
+        this->Max();
+    else if (moments == STAT_SUM)
+        this->Sum();
+    else if (moments == STAT_STD && single)
+        this->StdDeviation();
+    else if (moments != 0)
+        this->Moments();
+
+    if (missing & STAT_QUARTILES)
+        this->Quartiles();
+
+    return this->GetResults();
+};
+
+//Same partial layout as filter_stats over every record, float data is shifted by its first value before squaring so
+//the one pass variance does not cancel catastrophically, integer data sums exact squares
+template<class T>
+void WeatherAnalysis<T>::Moments() {
+    cl_uint count = this->data.size() - this->pad_right;
+    unsigned int group_count = this->data.size() / this->local_size;
+    float shift = std::numeric_limits<T>::is_integer ? 0.0f : (float) this->data[0];
+
+    BufferPool::Lease mins(this->pool, group_count * sizeof(T));
+    BufferPool::Lease maxs(this->pool, group_count * sizeof(T));
+    BufferPool::Lease sums(this->pool, group_count * this->acc_size);
+    BufferPool::Lease squares(this->pool, group_count * this->acc_size);
+
+    std::string kernel_ID("moments");
+    cl::Kernel &moments_kernel = this->GetKernel(kernel_ID);
+    moments_kernel.setArg(0, this->data_buffer);
+    moments_kernel.setArg(1, count);
+    moments_kernel.setArg(2, shift);
+    moments_kernel.setArg(3, mins.buffer);
+    moments_kernel.setArg(4, maxs.buffer);
+    moments_kernel.setArg(5, sums.buffer);
+    moments_kernel.setArg(6, squares.buffer);
+    moments_kernel.setArg(7, cl::Local(this->local_size * sizeof(T)));
+    moments_kernel.setArg(8, cl::Local(this->local_size * sizeof(T)));
+    moments_kernel.setArg(9, cl::Local(this->local_size * this->acc_size));
+    moments_kernel.setArg(10, cl::Local(this->local_size * this->acc_size));
+    this->EnqueueKernel(moments_kernel, kernel_ID);
+
+    this->minimum = this->ReduceExtremaPartials(mins.buffer, group_count, false);
+    this->maximum = this->ReduceExtremaPartials(maxs.buffer, group_count, true);
+    this->sum = this->ReduceAccumulatorPartials(sums.buffer, group_count);
+    acc_t sum_squares = this->ReduceAccumulatorPartials(squares.buffer, group_count);
+    this->average = (float) ((double) this->sum / (double) count);
+
+	//Sum of differences from the shift gives the shifted variance, equal to the variance of the data
+    long double shifted_sum = (long double) this->sum - (long double) shift * count;
+    long double variance = (sum_squares - shifted_sum * shifted_sum / count) / count;
+    this->std_deviation = (float) sqrt(variance > 0 ? variance : 0);
+
+    this->computed |= STAT_MIN | STAT_MAX | STAT_SUM | STAT_STD;
+};
+
+//Radix selection over the 32-bit order preserving keys: one histogram of the upper 16 bits gives the bin of every
+//quartile rank, one histogram of the lower 16 bits per distinct bin gives the exact value. Padding is excluded.
+template<class T>
+void WeatherAnalysis<T>::Quartiles() {
+    const unsigned int bins = 1 << 16;
+    cl_uint count = this->data.size() - this->pad_right;
+    if (count == 0)
+        return;
+
+    BufferPool::Lease histogram(this->pool, bins * sizeof(cl_uint));
+    std::vector<cl_uint> counts(bins);
+
+    std::string kernel_ID("key_histogram");
+    cl::Kernel &histogram_kernel = this->GetKernel(kernel_ID);
+    histogram_kernel.setArg(0, this->data_buffer);
+    histogram_kernel.setArg(1, count);
+    histogram_kernel.setArg(4, histogram.buffer);
+
+    auto count_keys = [&](cl_uint level, cl_uint prefix) {
+        this->queue.enqueueFillBuffer(histogram.buffer, (cl_uint) 0, 0, bins * sizeof(cl_uint));
+        histogram_kernel.setArg(2, level);
+        histogram_kernel.setArg(3, prefix);
+        this->EnqueueKernel(histogram_kernel, kernel_ID);
+        this->queue.enqueueReadBuffer(histogram.buffer, CL_TRUE, 0, bins * sizeof(cl_uint), &counts[0]);
+    };
+
+	//Walks the histogram to the bin holding the rank, leaving the rank within that bin
+    auto find_bin = [&](uint64_t &rank) {
+        uint32_t bin = 0;
+        while (bin < bins - 1 && rank >= counts[bin])
+            rank -= counts[bin++];
+        return bin;
+    };
+
+    const double quantiles[3] = {0.25, 0.5, 0.75};
+    T *targets[3] = {&this->first_quantile, &this->median, &this->third_quantile};
+    uint64_t ranks[3];
+    uint32_t prefixes[3];
+
+    count_keys(0, 0);
+    for (int i = 0; i < 3; ++i) {
+        ranks[i] = std::min<uint64_t>(count - 1, (uint64_t) round(count * quantiles[i]));
+        prefixes[i] = find_bin(ranks[i]);
+    }
+
+	//Ranks are ascending so quartiles sharing a bin reuse its histogram
+    for (int i = 0; i < 3; ++i) {
+        if (i == 0 || prefixes[i] != prefixes[i - 1])
+            count_keys(1, prefixes[i]);
+        *targets[i] = KeyValue(prefixes[i] << 16 | find_bin(ranks[i]));
+    }
+
+    this->computed |= STAT_QUARTILES;
+};
+
+template<class T>
+WeatherRecord WeatherAnalysis<T>::ArgMin() {
+    return this->ArgExtreme(false);
+};
+
+template<class T>
+WeatherRecord WeatherAnalysis<T>::ArgMax() {
+    return this->ArgExtreme(true);
+};
+
+template<class T>
+std::vector<WeatherRecord> WeatherAnalysis<T>::TopK(unsigned int k) {
+    return this->SelectK(k, true);
+};
+
+template<class T>
+std::vector<WeatherRecord> WeatherAnalysis<T>::BottomK(unsigned int k) {
+    return this->SelectK(k, false);
+};
+
+//Reduces (value, index) pairs to one per workgroup on the device then picks the best partial on the host
+template<class T>
+WeatherRecord WeatherAnalysis<T>::ArgExtreme(bool find_max) {
+    std::string kernel_ID("argextreme");
+    unsigned int group_count = this->data.size() / this->local_size;
+
+    BufferPool::Lease values(this->pool, group_count * sizeof(T));
+    BufferPool::Lease indices(this->pool, group_count * sizeof(cl_uint));
+
+    cl::Kernel &arg_kernel = this->GetKernel(kernel_ID);
+    arg_kernel.setArg(0, this->data_buffer);
+    arg_kernel.setArg(1, (cl_uint) (this->data.size() - this->pad_right));
+    arg_kernel.setArg(2, (cl_int) find_max);
+    arg_kernel.setArg(3, values.buffer);
+    arg_kernel.setArg(4, indices.buffer);
+    arg_kernel.setArg(5, cl::Local(this->local_size * sizeof(T)));
+    arg_kernel.setArg(6, cl::Local(this->local_size * sizeof(cl_uint)));
+
+    this->EnqueueKernel(arg_kernel, kernel_ID);
+
+    std::vector<T> group_values(group_count);
+    std::vector<cl_uint> group_indices(group_count);
+    this->queue.enqueueReadBuffer(values.buffer, CL_TRUE, 0, group_count * sizeof(T), &group_values[0]);
+    this->queue.enqueueReadBuffer(indices.buffer, CL_TRUE, 0, group_count * sizeof(cl_uint), &group_indices[0]);
+
+	//Same ordering as the kernel, lowest index wins ties
+    unsigned int best = 0;
+    for (unsigned int i = 1; i < group_count; ++i) {
+        bool better = find_max ? group_values[i] > group_values[best] : group_values[i] < group_values[best];
+        if (better || (group_values[i] == group_values[best] && group_indices[i] < group_indices[best]))
+            best = i;
+    }
+
+    return this->LookupRecord(group_indices[best], group_values[best]);
+};
+
+//Keeps the best k of every workgroup then merges the candidates on the device until one workgroup remains
+template<class T>
+std::vector<WeatherRecord> WeatherAnalysis<T>::SelectK(unsigned int k, bool find_max) {
+    if (k == 0 || k > (unsigned int) this->local_size / 2)
+        throw std::runtime_error("ERROR: k must be between 1 and half the local size.");
+
+    cl_uint count = this->data.size() - this->pad_right;
+    k = std::min<unsigned int>(k, count);
+    if (k == 0)
+        return std::vector<WeatherRecord>();
+    unsigned int group_count = this->data.size() / this->local_size;
+
+    BufferPool::Lease values(this->pool, group_count * k * sizeof(T));
+    BufferPool::Lease indices(this->pool, group_count * k * sizeof(cl_uint));
+
+    std::string kernel_ID("topk");
+    cl::Kernel &topk_kernel = this->GetKernel(kernel_ID);
+    topk_kernel.setArg(0, this->data_buffer);
+    topk_kernel.setArg(1, count);
+    topk_kernel.setArg(2, (cl_uint) k);
+    topk_kernel.setArg(3, (cl_int) find_max);
+    topk_kernel.setArg(4, values.buffer);
+    topk_kernel.setArg(5, indices.buffer);
+    topk_kernel.setArg(6, cl::Local(this->local_size * sizeof(T)));
+    topk_kernel.setArg(7, cl::Local(this->local_size * sizeof(cl_uint)));
+    this->EnqueueKernel(topk_kernel, kernel_ID);
+
+	//Each round shrinks the candidates by local_size / k
+    std::string merge_ID("topk_merge");
+    cl::Kernel &merge_kernel = this->GetKernel(merge_ID);
+    while (group_count > 1) {
+        cl_uint candidates = group_count * k;
+        group_count = (candidates + this->local_size - 1) / this->local_size;
+
+        BufferPool::Lease merged_values(this->pool, group_count * k * sizeof(T));
+        BufferPool::Lease merged_indices(this->pool, group_count * k * sizeof(cl_uint));
+
+        merge_kernel.setArg(0, values.buffer);
+        merge_kernel.setArg(1, indices.buffer);
+        merge_kernel.setArg(2, candidates);
+        merge_kernel.setArg(3, (cl_uint) k);
+        merge_kernel.setArg(4, (cl_int) find_max);
+        merge_kernel.setArg(5, merged_values.buffer);
+        merge_kernel.setArg(6, merged_indices.buffer);
+        merge_kernel.setArg(7, cl::Local(this->local_size * sizeof(T)));
+        merge_kernel.setArg(8, cl::Local(this->local_size * sizeof(cl_uint)));
+        this->EnqueueNDRangeKernel(merge_kernel, merge_ID, group_count * this->local_size);
+
+		//The merged candidates carry on, the leases of this round return the previous ones
+        std::swap(values.buffer, merged_values.buffer);
+        std::swap(indices.buffer, merged_indices.buffer);
+    }
+
+    std::vector<T> best_values(k);
+    std::vector<cl_uint> best_indices(k);
+    this->queue.enqueueReadBuffer(values.buffer, CL_TRUE, 0, k * sizeof(T), &best_values[0]);
+    this->queue.enqueueReadBuffer(indices.buffer, CL_TRUE, 0, k * sizeof(cl_uint), &best_indices[0]);
+
+    std::vector<WeatherRecord> records;
+    for (unsigned int i = 0; i < k; ++i)
+        records.push_back(this->LookupRecord(best_indices[i], best_values[i]));
+    return records;
+};
+
+template<class T>
+WeatherRecord WeatherAnalysis<T>::LookupRecord(uint32_t index, T value) {
+    WeatherRecord record = WeatherRecord();
+    record.value = value * this->scale;
+    record.index = index;
+
+	//Two single element reads, the record columns stay on the device
+    if (this->has_columns) {
+        uint16_t station = 0;
+        this->queue.enqueueReadBuffer(this->station_buffer, CL_TRUE, index * sizeof(uint16_t), sizeof(uint16_t), &station);
+        this->queue.enqueueReadBuffer(this->time_buffer, CL_TRUE, index * sizeof(uint32_t), sizeof(uint32_t), &record.timestamp);
+        record.station = station < this->station_names.size() ? this->station_names[station] : "";
+    }
+
+    return record;
+};
+
+template<class T>
+std::vector<uint32_t> WeatherAnalysis<T>::SortedIndices(Records::SortKey key) {
+    BufferPool::Lease indices(this->pool, this->SortKeys(key));
+
+	//Padding sorts last so the first count indices are the records
+    std::vector<uint32_t> order(this->data.size() - this->pad_right);
+    if (!order.empty())
+        this->queue.enqueueReadBuffer(indices.buffer, CL_TRUE, 0, order.size() * sizeof(cl_uint), &order[0]);
+    return order;
+};
+
+//Gathers the data and columns through the sorted indices so the records never visit the host unordered.
+//The gathers go to pooled buffers and are copied back, the data and column buffers keep their allocations.
+template<class T>
+void WeatherAnalysis<T>::OrderBy(Records::SortKey key) {
+    BufferPool::Lease indices(this->pool, this->SortKeys(key));
+    std::size_t size = this->data.size();
+
+    BufferPool::Lease out(this->pool, size * sizeof(T));
+    std::string gather_ID("key_gather");
+    cl::Kernel &gather_kernel = this->GetKernel(gather_ID);
+    gather_kernel.setArg(0, this->data_buffer);
+    gather_kernel.setArg(1, indices.buffer);
+    gather_kernel.setArg(2, out.buffer);
+    this->EnqueueKernel(gather_kernel, gather_ID);
+    this->queue.enqueueCopyBuffer(out.buffer, this->data_buffer, 0, 0, size * sizeof(T));
+
+    if (this->has_columns) {
+        BufferPool::Lease out_stations(this->pool, size * sizeof(uint16_t));
+        BufferPool::Lease out_times(this->pool, size * sizeof(uint32_t));
+        std::string columns_ID("key_gather_columns");
+        cl::Kernel &columns_kernel = this->GetKernel(columns_ID);
+        columns_kernel.setArg(0, this->station_buffer);
+        columns_kernel.setArg(1, this->time_buffer);
+        columns_kernel.setArg(2, indices.buffer);
+        columns_kernel.setArg(3, out_stations.buffer);
+        columns_kernel.setArg(4, out_times.buffer);
+        this->EnqueueKernel(columns_kernel, columns_ID);
+
+        this->queue.enqueueCopyBuffer(out_stations.buffer, this->station_buffer, 0, 0, size * sizeof(uint16_t));
+        this->queue.enqueueCopyBuffer(out_times.buffer, this->time_buffer, 0, 0, size * sizeof(uint32_t));
+    }
+
+	//Padding stays at the end, the host copy follows the new order
+    this->queue.enqueueReadBuffer(this->data_buffer, CL_TRUE, 0, size * sizeof(T), &this->data[0]);
+};
+
+//Bitonic network over a power of two: log2(n) * (log2(n) + 1) / 2 compare and swap steps where every step below
+//the local size runs in local memory, so the number of passes depends only on the data and local sizes
+template<class T>
+cl::Buffer WeatherAnalysis<T>::SortKeys(Records::SortKey key) {
+    if (key != Records::SORT_VALUE && !this->has_columns)
+        throw std::runtime_error("ERROR: Sorting by station and timestamp requires record columns, call SetColumns first.");
+
+    cl_uint count = this->data.size() - this->pad_right;
+    cl_uint padded = this->local_size;
+    while (padded < this->data.size())
+        padded <<= 1;
+
+    BufferPool::Lease keys(this->pool, padded * sizeof(cl_ulong));
+    cl::Buffer indices = this->pool.Acquire(padded * sizeof(cl_uint));
+
+    std::string keys_ID(key == Records::SORT_VALUE ? "sort_keys_value" : "sort_keys_record");
+    cl::Kernel &keys_kernel = this->GetKernel(keys_ID);
+    unsigned int arg = 0;
+    if (key == Records::SORT_VALUE) {
+        keys_kernel.setArg(arg++, this->data_buffer);
+    } else {
+        keys_kernel.setArg(arg++, this->station_buffer);
+        keys_kernel.setArg(arg++, this->time_buffer);
+    }
+    keys_kernel.setArg(arg++, count);
+    if (key != Records::SORT_VALUE)
+        keys_kernel.setArg(arg++, (cl_uint) (key == Records::SORT_TIME_STATION));
+    keys_kernel.setArg(arg++, keys.buffer);
+    keys_kernel.setArg(arg++, indices);
+    this->EnqueueNDRangeKernel(keys_kernel, keys_ID, padded);
+
+    std::string local_ID("key_sort_local"), global_ID("key_sort_global");
+    cl::Kernel &local_kernel = this->GetKernel(local_ID);
+    cl::Kernel &global_kernel = this->GetKernel(global_ID);
+    local_kernel.setArg(0, keys.buffer);
+    local_kernel.setArg(1, indices);
+    local_kernel.setArg(3, cl::Local(this->local_size * sizeof(cl_ulong)));
+    local_kernel.setArg(4, cl::Local(this->local_size * sizeof(cl_uint)));
+    global_kernel.setArg(0, keys.buffer);
+    global_kernel.setArg(1, indices);
+
+	//Size 0 sorts every workgroup, then each larger block merges across workgroups before finishing locally
+    local_kernel.setArg(2, (cl_uint) 0);
+    this->EnqueueNDRangeKernel(local_kernel, local_ID, padded);
+    for (cl_uint size = this->local_size * 2; size <= padded; size <<= 1) {
+        global_kernel.setArg(2, size);
+        for (cl_uint stride = size / 2; stride >= (cl_uint) this->local_size; stride >>= 1) {
+            global_kernel.setArg(3, stride);
+            this->EnqueueNDRangeKernel(global_kernel, global_ID, padded);
+        }
+        local_kernel.setArg(2, size);
+        this->EnqueueNDRangeKernel(local_kernel, local_ID, padded);
+    }
+
+    return indices;
+};
+
+//Device join on the timestamp: records sorted by timestamp then station are scattered into a dense timestamp by
+//station matrix, then every pair of columns is reduced over the rows where both are present (pairwise complete).
+//Duplicate records of a station at one timestamp share a cell and only one of them is kept.
+template<class T>
+CorrelationMatrix WeatherAnalysis<T>::Correlation() {
+    if (!this->has_columns)
+        throw std::runtime_error("ERROR: Correlation requires record columns, call SetColumns first.");
+
+    cl::Device device = this->context.getInfo<CL_CONTEXT_DEVICES>()[0];
+    std::size_t size = this->data.size();
+    cl_uint count = size - this->pad_right;
+    unsigned int stations = this->station_names.size();
+    unsigned int group_count = size / this->local_size;
+
+    CorrelationMatrix result;
+    result.stations = this->station_names;
+    result.covariance.assign(stations * stations, std::numeric_limits<double>::quiet_NaN());
+    result.correlation.assign(stations * stations, std::numeric_limits<double>::quiet_NaN());
+    result.samples.assign(stations * stations, 0);
+    if (stations == 0 || count == 0)
+        return result;
+
+	//Values are stored relative to the mean so the sums of squares keep their precision, covariance is unchanged
+    this->Query(STAT_SUM);
+    float shift = this->average;
+
+	//Records in timestamp then station order with their columns
+    BufferPool::Lease indices(this->pool, this->SortKeys(Records::SORT_TIME_STATION));
+    BufferPool::Lease values(this->pool, size * sizeof(T));
+    BufferPool::Lease sorted_stations(this->pool, size * sizeof(uint16_t));
+    BufferPool::Lease sorted_times(this->pool, size * sizeof(uint32_t));
+
+    std::string gather_ID("key_gather"), columns_ID("key_gather_columns");
+    cl::Kernel &gather_kernel = this->GetKernel(gather_ID);
+    gather_kernel.setArg(0, this->data_buffer);
+    gather_kernel.setArg(1, indices.buffer);
+    gather_kernel.setArg(2, values.buffer);
+    this->EnqueueKernel(gather_kernel, gather_ID);
+
+    cl::Kernel &columns_kernel = this->GetKernel(columns_ID);
+    columns_kernel.setArg(0, this->station_buffer);
+    columns_kernel.setArg(1, this->time_buffer);
+    columns_kernel.setArg(2, indices.buffer);
+    columns_kernel.setArg(3, sorted_stations.buffer);
+    columns_kernel.setArg(4, sorted_times.buffer);
+    this->EnqueueKernel(columns_kernel, columns_ID);
+
+	//Number the distinct timestamps, each one is a row of the matrix
+    BufferPool::Lease flags(this->pool, size * sizeof(cl_uchar));
+    BufferPool::Lease positions(this->pool, size * sizeof(cl_uint));
+    BufferPool::Lease offsets(this->pool, group_count * sizeof(cl_uint));
+
+    std::string flags_ID("align_flags");
+    cl::Kernel &flags_kernel = this->GetKernel(flags_ID);
+    flags_kernel.setArg(0, sorted_times.buffer);
+    flags_kernel.setArg(1, count);
+    flags_kernel.setArg(2, flags.buffer);
+    this->EnqueueKernel(flags_kernel, flags_ID);
+    cl_uint rows = this->ScanFlags(flags.buffer, positions.buffer, offsets.buffer);
+
+	//Small station counts use 8 x 8 tiles so fewer work items idle on padding columns
+    unsigned int tile = stations <= 8 || device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() < 256 ? 8 : 16;
+    cl_uint stride = (stations + tile - 1) / tile * tile;
+    cl_uint padded_rows = (rows + tile - 1) / tile * tile;
+    std::size_t cells = (std::size_t) padded_rows * stride;
+	//The pool rounds the matrix up to its size class, which is what the device has to allocate
+    if (BufferPool::SizeClass(cells * sizeof(cl_float)) > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() || cells > std::numeric_limits<cl_uint>::max())
+        throw std::runtime_error("ERROR: Too many distinct timestamps for the aligned matrix on this device.");
+
+    BufferPool::Lease X(this->pool, cells * sizeof(cl_float));
+    BufferPool::Lease M(this->pool, cells * sizeof(cl_uchar));
+    this->queue.enqueueFillBuffer(X.buffer, (cl_float) 0, 0, cells * sizeof(cl_float));
+    this->queue.enqueueFillBuffer(M.buffer, (cl_uchar) 0, 0, cells * sizeof(cl_uchar));
+
+    std::string scatter_ID("align_scatter");
+    cl::Kernel &scatter_kernel = this->GetKernel(scatter_ID);
+    scatter_kernel.setArg(0, values.buffer);
+    scatter_kernel.setArg(1, sorted_stations.buffer);
+    scatter_kernel.setArg(2, flags.buffer);
+    scatter_kernel.setArg(3, positions.buffer);
+    scatter_kernel.setArg(4, offsets.buffer);
+    scatter_kernel.setArg(5, count);
+    scatter_kernel.setArg(6, shift);
+    scatter_kernel.setArg(7, stride);
+    scatter_kernel.setArg(8, X.buffer);
+    scatter_kernel.setArg(9, M.buffer);
+    this->EnqueueKernel(scatter_kernel, scatter_ID);
+
+	//Rows are split so there are a few workgroups per compute unit whatever the number of stations
+    unsigned int tiles = (stride / tile) * (stride / tile);
+    cl_uint splits = std::max<unsigned int>(1, std::min<unsigned int>(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4 / tiles, padded_rows / tile));
+    bool fp64 = this->build_options.find("WA_FP64") != std::string::npos;
+    std::size_t acc_bytes = fp64 ? sizeof(cl_double) : sizeof(cl_float);
+    std::size_t partial_count = (std::size_t) splits * 6 * stride * stride;
+    BufferPool::Lease partials(this->pool, partial_count * acc_bytes);
+
+    std::string pair_ID("pair_moments");
+    cl::Kernel &pair_kernel = tile == 16 ? this->GetKernel(pair_ID) : this->GetKernel(pair_ID, this->KernelOptions() + " -DTILE=" + std::to_string(tile));
+    pair_kernel.setArg(0, X.buffer);
+    pair_kernel.setArg(1, M.buffer);
+    pair_kernel.setArg(2, stride);
+    pair_kernel.setArg(3, padded_rows);
+    pair_kernel.setArg(4, splits);
+    pair_kernel.setArg(5, partials.buffer);
+    for (unsigned int arg = 6; arg < 10; ++arg)
+        pair_kernel.setArg(arg, cl::Local(tile * tile * sizeof(cl_float)));
+    this->EnqueueNDRangeKernel(pair_kernel, pair_ID, cl::NDRange(stride, stride * splits), cl::NDRange(tile, tile));
+
+	//Sum the splits in double on the host
+    std::vector<double> sums(6 * stride * stride, 0.0);
+    if (fp64) {
+        std::vector<cl_double> host(partial_count);
+        this->queue.enqueueReadBuffer(partials.buffer, CL_TRUE, 0, partial_count * acc_bytes, &host[0]);
+        for (std::size_t i = 0; i < partial_count; ++i)
+            sums[i % sums.size()] += host[i];
+    } else {
+        std::vector<cl_float> host(partial_count);
+        this->queue.enqueueReadBuffer(partials.buffer, CL_TRUE, 0, partial_count * acc_bytes, &host[0]);
+        for (std::size_t i = 0; i < partial_count; ++i)
+            sums[i % sums.size()] += host[i];
+    }
+
+	//Population covariance like the standard deviation, correlation needs two shared timestamps and variance in both
+    std::size_t matrix = (std::size_t) stride * stride;
+    double scale = this->scale;
+    for (unsigned int a = 0; a < stations; ++a) {
+        for (unsigned int b = 0; b < stations; ++b) {
+            std::size_t index = (std::size_t) a * stride + b, cell = a * stations + b;
+            double n = sums[index], sa = sums[matrix + index], sb = sums[2 * matrix + index];
+            double saa = sums[3 * matrix + index], sbb = sums[4 * matrix + index], sab = sums[5 * matrix + index];
+            result.samples[cell] = (uint64_t) (n + 0.5);
+            if (n < 1)
+                continue;
+
+            double cab = sab - sa * sb / n, caa = saa - sa * sa / n, cbb = sbb - sb * sb / n;
+            result.covariance[cell] = cab / n * scale * scale;
+            if (n >= 2 && caa > 0 && cbb > 0)
+                result.correlation[cell] = std::max(-1.0, std::min(1.0, cab / sqrt(caa * cbb)));
+        }
+    }
+    return result;
+};
+
+//Two device passes: per group baseline moments then flagging, only the flagged records are read back
+template<class T>
+std::vector<WeatherAnomaly> WeatherAnalysis<T>::DetectAnomalies(float threshold, Records::Grouping grouping, const std::vector<float> &group_thresholds) {
+    if (!this->has_columns)
+        throw std::runtime_error("ERROR: Anomaly detection requires record columns, call SetColumns first.");
+
+    cl::Device device = this->context.getInfo<CL_CONTEXT_DEVICES>()[0];
+    cl_uint count = this->data.size() - this->pad_right;
+    unsigned int group_count = Records::GroupCount(grouping, this->station_names.size());
+    float fixed_scale = std::numeric_limits<T>::is_integer ? 1.0f : 1000.0f;
+
+	//A few workgroups per compute unit loop over all records, groups are split into chunks that fit local memory
+    unsigned int workgroups = std::max<unsigned int>(1, std::min<unsigned int>(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4, this->data.size() / this->local_size));
+    unsigned int chunk = std::max<unsigned int>(1, std::min<unsigned int>(group_count, device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 2 / (5 * sizeof(cl_uint))));
+
+    std::vector<float> thresholds(group_thresholds);
+    thresholds.resize(group_count, threshold);
+
+    BufferPool::Lease partials(this->pool, workgroups * chunk * 3 * sizeof(cl_ulong));
+    BufferPool::Lease means(this->pool, group_count * sizeof(cl_float));
+    BufferPool::Lease stds(this->pool, group_count * sizeof(cl_float));
+    cl::Buffer thresholds_buffer(this->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, group_count * sizeof(cl_float), &thresholds[0]);
+
+    std::string moments_ID("group_moments");
+    cl::Kernel &moments_kernel = this->GetKernel(moments_ID);
+    cl::Kernel &baseline_kernel = this->GetKernel("group_baseline");
+
+    for (unsigned int offset = 0; offset < group_count; offset += chunk) {
+        cl_uint groups = std::min(chunk, group_count - offset);
+
+        moments_kernel.setArg(0, this->data_buffer);
+        moments_kernel.setArg(1, this->station_buffer);
+        moments_kernel.setArg(2, this->time_buffer);
+        moments_kernel.setArg(3, count);
+        moments_kernel.setArg(4, (cl_int) grouping);
+        moments_kernel.setArg(5, (cl_uint) offset);
+        moments_kernel.setArg(6, groups);
+        moments_kernel.setArg(7, fixed_scale);
+        moments_kernel.setArg(8, partials.buffer);
+        moments_kernel.setArg(9, cl::Local(groups * 5 * sizeof(cl_uint)));
+        this->EnqueueNDRangeKernel(moments_kernel, moments_ID, workgroups * this->local_size);
+
+        baseline_kernel.setArg(0, partials.buffer);
+        baseline_kernel.setArg(1, (cl_uint) workgroups);
+        baseline_kernel.setArg(2, groups);
+        baseline_kernel.setArg(3, (cl_uint) offset);
+        baseline_kernel.setArg(4, fixed_scale);
+        baseline_kernel.setArg(5, means.buffer);
+        baseline_kernel.setArg(6, stds.buffer);
+        this->EnqueueNDRangeKernel(baseline_kernel, "group_baseline", ((groups + this->local_size - 1) / this->local_size) * this->local_size);
+    }
+
+	//Second pass flags every record beyond the threshold of its group
+    std::string flags_ID("anomaly_flags");
+    this->AllocateFlags();
+    cl::Kernel &flags_kernel = this->GetKernel(flags_ID);
+    flags_kernel.setArg(0, this->data_buffer);
+    flags_kernel.setArg(1, this->station_buffer);
+    flags_kernel.setArg(2, this->time_buffer);
+    flags_kernel.setArg(3, count);
+    flags_kernel.setArg(4, (cl_int) grouping);
+    flags_kernel.setArg(5, means.buffer);
+    flags_kernel.setArg(6, stds.buffer);
+    flags_kernel.setArg(7, thresholds_buffer);
+    flags_kernel.setArg(8, this->flags_buffer);
+    this->EnqueueKernel(flags_kernel, flags_ID);
+
+	//Compact the flagged records on the device (see Select)
+    BufferPool::Lease positions(this->pool, this->data.size() * sizeof(cl_uint));
+    BufferPool::Lease offsets(this->pool, this->data.size() / this->local_size * sizeof(cl_uint));
+    cl_uint total = this->ScanFlags(this->flags_buffer, positions.buffer, offsets.buffer);
+
+    std::vector<WeatherAnomaly> anomalies;
+    if (total == 0)
+        return anomalies;
+
+    BufferPool::Lease out(this->pool, total * sizeof(T));
+    BufferPool::Lease out_stations(this->pool, total * sizeof(uint16_t));
+    BufferPool::Lease out_times(this->pool, total * sizeof(uint32_t));
+    BufferPool::Lease out_indices(this->pool, total * sizeof(cl_uint));
+
+    std::string compact_ID("compact");
+    cl::Kernel &compact_kernel = this->GetKernel(compact_ID);
+    compact_kernel.setArg(0, this->data_buffer);
+    compact_kernel.setArg(1, this->station_buffer);
+    compact_kernel.setArg(2, this->time_buffer);
+    compact_kernel.setArg(3, this->flags_buffer);
+    compact_kernel.setArg(4, positions.buffer);
+    compact_kernel.setArg(5, offsets.buffer);
+    compact_kernel.setArg(6, out.buffer);
+    compact_kernel.setArg(7, out_stations.buffer);
+    compact_kernel.setArg(8, out_times.buffer);
+    this->EnqueueKernel(compact_kernel, compact_ID);
+
+    cl::Kernel &indices_kernel = this->GetKernel("compact_indices");
+    indices_kernel.setArg(0, this->flags_buffer);
+    indices_kernel.setArg(1, positions.buffer);
+    indices_kernel.setArg(2, offsets.buffer);
+    indices_kernel.setArg(3, out_indices.buffer);
+    this->EnqueueKernel(indices_kernel, "compact_indices");
+
+    std::vector<T> values(total);
+    std::vector<uint16_t> stations(total);
+    std::vector<uint32_t> timestamps(total), indices(total);
+    std::vector<float> group_means(group_count), group_stds(group_count);
+    this->queue.enqueueReadBuffer(out.buffer, CL_TRUE, 0, total * sizeof(T), &values[0]);
+    this->queue.enqueueReadBuffer(out_stations.buffer, CL_TRUE, 0, total * sizeof(uint16_t), &stations[0]);
+    this->queue.enqueueReadBuffer(out_times.buffer, CL_TRUE, 0, total * sizeof(uint32_t), &timestamps[0]);
+    this->queue.enqueueReadBuffer(out_indices.buffer, CL_TRUE, 0, total * sizeof(cl_uint), &indices[0]);
+    this->queue.enqueueReadBuffer(means.buffer, CL_TRUE, 0, group_count * sizeof(cl_float), &group_means[0]);
+    this->queue.enqueueReadBuffer(stds.buffer, CL_TRUE, 0, group_count * sizeof(cl_float), &group_stds[0]);
+
+    for (cl_uint i = 0; i < total; ++i) {
+        WeatherAnomaly anomaly;
+        anomaly.record.value = values[i] * this->scale;
+        anomaly.record.index = indices[i];
+        anomaly.record.station = stations[i] < this->station_names.size() ? this->station_names[stations[i]] : "";
+        anomaly.record.timestamp = timestamps[i];
+        anomaly.group = Records::GroupOf(grouping, stations[i], timestamps[i]);
+        anomaly.z_score = (values[i] - group_means[anomaly.group]) / group_stds[anomaly.group];
+        anomalies.push_back(anomaly);
+    }
+
+    return anomalies;
+};
+
+//Every workgroup sorts its chunk and keeps every other value (one compaction), the samples are compacted again on the
+//device until they fit the sketch. Chunks that do not fill a workgroup are handed to the host sketch at their level.
+template<class T>
+QuantileSketch WeatherAnalysis<T>::Sketch(double epsilon) {
+    QuantileSketch sketch(epsilon);
+    cl_uint count = this->data.size() - this->pad_right;
+    cl_uint samples = (count / this->local_size) * this->local_size;
+    unsigned int level = 0, round = 0;
+
+    std::string kernel_ID("sketch_compact");
+    cl::Kernel &sketch_kernel = this->GetKernel(kernel_ID);
+    cl::Buffer values = this->data_buffer;
+	//At most two rounds of samples are alive at once, a half and a quarter of the data, the earlier goes back to the pool
+    while (samples > sketch.Capacity() && samples >= (cl_uint) this->local_size) {
+        cl::Buffer compacted = this->pool.Acquire(samples / 2 * sizeof(T));
+
+        sketch_kernel.setArg(0, values);
+        sketch_kernel.setArg(1, (cl_uint) (round++ & 1));
+        sketch_kernel.setArg(2, compacted);
+        sketch_kernel.setArg(3, cl::Local(this->local_size * sizeof(T)));
+        sketch_kernel.setArg(4, cl::Local(this->local_size * sizeof(cl_uint)));
+        this->EnqueueNDRangeKernel(sketch_kernel, kernel_ID, samples);
+
+        if (level > 0)
+            this->pool.Release(values);
+        values = compacted;
+        samples /= 2;
+        level++;
+
+		//Samples past the last full workgroup go to the host at the level they reached
+        cl_uint full = (samples / this->local_size) * this->local_size;
+        if (samples > full && samples > sketch.Capacity()) {
+            std::vector<T> tail(samples - full);
+            this->queue.enqueueReadBuffer(values, CL_TRUE, full * sizeof(T), tail.size() * sizeof(T), &tail[0]);
+            std::vector<float> degrees;
+            for (T value : tail)
+                degrees.push_back(value * this->scale);
+            sketch.Insert(degrees, level);
+            samples = full;
+        }
+    }
+
+    std::vector<T> compacted_values(samples);
+    if (samples > 0)
+        this->queue.enqueueReadBuffer(values, CL_TRUE, 0, samples * sizeof(T), &compacted_values[0]);
+    if (level > 0)
+        this->pool.Release(values);
+    std::vector<float> degrees;
+    for (T value : compacted_values)
+        degrees.push_back(value * this->scale);
+    sketch.Insert(degrees, level);
+
+	//Records that do not fill the last workgroup were never compacted
+    degrees.clear();
+    for (cl_uint i = (count / this->local_size) * this->local_size; i < count; ++i)
+        degrees.push_back(this->data[i] * this->scale);
+    sketch.Insert(degrees, 0);
+
+    return sketch;
+};
+
+template<class T>
+double WeatherAnalysis<T>::Quantile(double q, double epsilon) {
+    if (!this->has_sketch || this->sketch_epsilon != epsilon) {
+        this->sketch = this->Sketch(epsilon);
+        this->sketch_epsilon = epsilon;
+        this->has_sketch = true;
+    }
+    return this->sketch.Quantile(q);
 };
 
 //Template function to return string type of T
@@ -440,14 +1565,27 @@ void WeatherAnalysis<T>::TypeCheck() {
 template<>
 void WeatherAnalysis<float>::TypeCheck() {
     this->type = "FLOAT";
+    this->device_type = "float";
+    this->type_options = "-DTYPE_MIN=-INFINITY -DTYPE_MAX=INFINITY -DTYPE_FLOAT";
 };
 
 template<>
 void WeatherAnalysis<int>::TypeCheck() {
     this->type = "INT";
+    this->device_type = "int";
+    this->type_options = "-DTYPE_MIN=INT_MIN -DTYPE_MAX=INT_MAX";
+};
+
+//Stored as tenths of a degree
+template<>
+void WeatherAnalysis<int16_t>::TypeCheck() {
+    this->type = "SHORT";
+    this->device_type = "short";
+    this->type_options = "-DTYPE_MIN=SHRT_MIN -DTYPE_MAX=SHRT_MAX";
+    this->scale = 0.1f;
 };
 
-//Forces templated class to only allow float and int type
+//Forces templated class to only allow float, int and int16 type
 // Seperates class and implementation file.
 template
 class WeatherAnalysis<float>;
@@ -455,4 +1593,7 @@ class WeatherAnalysis<float>;
 template
 class WeatherAnalysis<int>;
 
+template
+class WeatherAnalysis<int16_t>;
+
 #pragma clang diagnostic pop
\ No newline at end of file
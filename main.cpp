@@ -1,12 +1,18 @@
 //Raymond Kirk - 14474219@students.lincoln.ac.uk
 
 #include <iostream>
+#include <iomanip>
 #include <vector>
 #include <string>
+#include <utility>
 #include "SimpleTimer.hpp"
 
 #include "WeatherAnalysis.hpp"
 #include "Parser.hpp"
+#include "StreamParser.hpp"
+#include "Server.hpp"
+#include "Batch.hpp"
+#include "ResultCache.hpp"
 
 int main(int argc, char **argv) {
 	//Enable a timer to measure overall host code execution time
@@ -23,18 +29,77 @@ int main(int argc, char **argv) {
     std::string file_path = root + "/data/temp_lincolnshire_short.txt";
     std::string kernels_path = root + "/opencl/kernels.cl";
 
+	//Optional server mode, "-s <socket path>" or "-s -" to answer queries from stdin
+	//Optional batch mode, "-b <directory or list file>" to analyse many files in one context
+	//with "-q <file>" merging the quantile sketch of the batch into a serialized sketch file
+	//Optional "-c <file>" keeps computed statistics in a result cache file between runs
+    std::string serve_path = "", batch_path = "", sketch_path = "", cache_path = "";
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-s") == 0)
+            serve_path = argv[i + 1];
+        else if (strcmp(argv[i], "-b") == 0)
+            batch_path = argv[i + 1];
+        else if (strcmp(argv[i], "-q") == 0)
+            sketch_path = argv[i + 1];
+        else if (strcmp(argv[i], "-c") == 0)
+            cache_path = argv[i + 1];
+    }
+
 	//Parse the data file and set the typedef for the entire enviroment
-    typedef int T;
-    std::vector<T> data = Parse::File<T>(file_path);
-    std::cout << "Size: " << data.size() << ", Last: " << data.back() << '\n' << std::endl;
+	//int16_t stores tenths of a degree in half the memory of int/float (int truncated whole degrees), results and
+	//printed values are always scaled back to degrees
+    typedef int16_t T;
+
+	//Results are always cached in memory, and kept on disk between runs with -c
+    ResultCache cache(cache_path);
+
+	//Batch mode keeps one context alive and pipelines parse, upload and compute over every file,
+	//the device is only set up when the cache cannot answer every file
+    if (!batch_path.empty()) {
+        WeatherAnalysis<T> world;
+        world.CmdParser(argc, argv);
+
+        BatchAnalysis<T> batch(world, cache, BatchAnalysis<T>::ListFiles(batch_path));
+        if (batch.Lookup() > 0) {
+            world.Initialise(kernels_path);
+            world.Configure(512, 0);
+        }
+        batch.Run();
+        batch.PrintTable();
+        cache.Save();
+        if (!sketch_path.empty())
+            batch.SaveSketch(sketch_path);
+        return 0;
+    }
+
+	//Statistics of an unchanged file are printed from the cache file without parsing or a device
+    std::string data_key = cache_path.empty() && serve_path.empty() ? "" : cache.DataKey<T>(file_path);
+    if (!cache_path.empty() && serve_path.empty()) {
+        const ResultCache::Entry *entry = cache.Find(data_key, ResultCache::QueryKey(), STAT_ALL);
+        if (entry) {
+            std::cout << "Results from cache " << cache_path << '\n';
+            WeatherAnalysis<T>::PrintResults(entry->results);
+            cache.Save();
+            std::cout << "Program terminated in: " << std::fixed << t.Toc() / 1000000 << "ms" << std::endl;
+            return 0;
+        }
+    }
 
-	//Initialise the Analysis world variable with cmd args and path
-    WeatherAnalysis<T> world(data);
+	//Station and time columns are parsed alongside so filters can be evaluated on the device, SetColumns releases them
+    std::vector<T> data;
+    Records::Columns columns;
+    Parse::RecordFile(file_path, data, columns);
+    std::size_t size = data.size();
+    T last = data.empty() ? 0 : data.back();
+
+	//Initialise the Analysis world variable with cmd args and path, the world takes ownership of the data
+    WeatherAnalysis<T> world(std::move(data));
+    std::cout << "Size: " << size << ", Last: " << last * world.GetScale() << '\n' << std::endl;
     world.CmdParser(argc, argv);
     world.Initialise(kernels_path);
 
-	//Configure the world to use a size of 512
-    world.Configure(512, 0);
+	//Configure the world to use a size of 512, reductions fold four elements per work item
+    world.Configure(512, 0, 4);
 
 	//Optionally configure flags to determine kernel execution and verbose printing
     world.SetVerboseKernel(false);
@@ -45,19 +110,60 @@ int main(int argc, char **argv) {
 	//Mandatory functions to call initially
 	world.PadData();
 	world.WriteDataToDevice();
+	world.SetColumns(std::move(columns));
+
+	//Keep the data and device buffers resident and answer queries until shutdown
+    if (!serve_path.empty()) {
+        AnalysisServer<T> server(world, cache, data_key);
+        std::cout << "Setup completed in: " << std::fixed << t.Toc() / 1000000 << "ms" << std::endl;
+        if (serve_path == "-")
+            server.ServeStream(std::cin, std::cout);
+        else
+            server.ServeSocket(serve_path);
+        cache.Save();
+        return 0;
+    }
 
 	//Print comparable statistics
     world.PrintBaselineResults();
 
-	//Execute statistic kernels
-    world.Min();
-    world.Max();
-    world.Sum();
-    world.StdDeviation();
-    world.Sort();
+	//Request every statistic, the planner fuses the moments and selects the quartiles without sorting
+    WeatherResults results = world.Query(STAT_ALL);
+    if (!data_key.empty()) {
+        cache.Store(data_key, ResultCache::QueryKey(), results);
+        cache.Save();
+    }
 
 	//Print results and execution time
     world.PrintResults();
+    world.GetMemoryUsage().Print(std::cout);
+
+	//Records behind the extremes and the five hottest readings
+    WeatherRecord coldest = world.ArgMin(), hottest = world.ArgMax();
+    std::cout << "Coldest: " << coldest.value << " at " << coldest.station << " " << Records::FormatTimestamp(coldest.timestamp) << '\n';
+    std::cout << "Hottest: " << hottest.value << " at " << hottest.station << " " << Records::FormatTimestamp(hottest.timestamp) << '\n';
+    for (auto const &record : world.TopK(5))
+        std::cout << "\t" << record.value << " at " << record.station << " " << Records::FormatTimestamp(record.timestamp) << '\n';
+    std::cout << std::endl;
+
+	//Readings more than 4 standard deviations from their station/month norm
+    std::vector<WeatherAnomaly> anomalies = world.DetectAnomalies(4.0f, Records::GROUP_STATION_MONTH);
+    std::cout << "Anomalies: " << anomalies.size() << '\n';
+    for (auto const &anomaly : anomalies)
+        std::cout << "\t" << anomaly.record.value << " at " << anomaly.record.station << " "
+                  << Records::FormatTimestamp(anomaly.record.timestamp) << " (z = " << anomaly.z_score << ")\n";
+    std::cout << std::endl;
+
+	//How closely the stations follow each other over the readings they share
+    CorrelationMatrix correlation = world.Correlation();
+    std::cout << "Correlation:\n";
+    for (std::size_t a = 0; a < correlation.stations.size(); ++a) {
+        std::cout << "\t" << std::left << std::setw(16) << correlation.stations[a] << std::right;
+        for (std::size_t b = 0; b < correlation.stations.size(); ++b)
+            std::cout << std::setw(8) << std::setprecision(3) << correlation.correlation[a * correlation.stations.size() + b];
+        std::cout << '\n';
+    }
+    std::cout << std::endl;
     std::cout << "Program terminated in: " << std::fixed << t.Toc() / 1000000 << "ms" << std::endl;
 
 	//Wait for input before termination
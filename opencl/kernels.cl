@@ -1,460 +1,768 @@
 //Raymond Kirk - 14474219@students.lincoln.ac.uk
 
 //OpenCL Kernel Code
-// Organised into three main distinct kernel types:
-//		*_INT				- Integer kernel that calculates using type int and atomic functions
-//		*_FLOAT				- Float kernel that reduces partial results to single result in the kernel
-//		*_WG_REDUCE_FLOAT	- Kernel that is reduced on the host side with multiple kernel calls (Slower)
+// Every kernel is written once and specialised when the program is built, WeatherAnalysis keeps one program per set of options:
+//		-DTYPE=short|int|float		- Element type of the data
+//		-DACC=long|double|float		- Accumulator for sums of TYPE, wide so totals are exact over very large datasets
+//		-DTYPE_MIN/-DTYPE_MAX		- Limits of TYPE, the identity of max/min
+//		-DTYPE_FLOAT				- Defined for floating point element types
+//		-DLOCAL_SIZE=N				- Workgroup size, loops over the workgroup have constant trip counts and unroll
+//		-DITEMS=N					- Elements each work item folds before the reduction tree (reduce only)
+//		-DOP=OP_MIN|OP_MAX|OP_SUM|OP_SUMSQ - Operator of the reduce kernel, programs built with OP only contain reduce
+//		-DWA_FP64					- Device supports doubles (cl_khr_fp64)
 //Main pattern used is reduction and comments are provided for specific features of each function only, not repeating ones.
+//Reductions write one partial result per workgroup which the host (or another reduce pass) combines.
+
+#ifdef WA_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double acc_float;
+#else
+typedef float acc_float;
+#endif
+
+//Defaults so the source also compiles on its own, the host always passes every option
+#ifndef TYPE
+#define TYPE int
+#define TYPE_MIN INT_MIN
+#define TYPE_MAX INT_MAX
+#endif
+#ifndef ACC
+#define ACC long
+#endif
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 256
+#endif
+#ifndef ITEMS
+#define ITEMS 1
+#endif
+
+#define OP_MIN 0
+#define OP_MAX 1
+#define OP_SUM 2
+#define OP_SUMSQ 3
+
+#define WORKGROUP __attribute__((reqd_work_group_size(LOCAL_SIZE, 1, 1)))
+
+#ifdef OP
+
+//Reduction operator
+//	load maps an element to the accumulator (squared distance from shift for OP_SUMSQ), combine merges two
+//	accumulators and IDENTITY is the value of work items past the end of the input.
+#if OP == OP_MIN
+#define IDENTITY TYPE_MAX
+#elif OP == OP_MAX
+#define IDENTITY TYPE_MIN
+#else
+#define IDENTITY 0
+#endif
+
+inline ACC load(TYPE a, float shift) {
+#if OP == OP_SUMSQ
+    ACC difference = (ACC) a - (ACC) shift;
+    return difference * difference;
+#else
+    return (ACC) a;
+#endif
+}
 
-__kernel void min_INT(__global const int *A, __global int *B, __local int *local_min) {
-    //Get ID, local ID and width of local workgroup
-    int id = get_global_id(0);
+inline ACC combine(ACC a, ACC b) {
+#if OP == OP_MIN
+    return a < b ? a : b;
+#elif OP == OP_MAX
+    return a > b ? a : b;
+#else
+    return a + b;
+#endif
+}
+
+//Each work item folds ITEMS elements strided by the workgroup size (coalesced) then the workgroup
+//reduces to a single partial in B[group]. n is the number of elements in A.
+__kernel WORKGROUP void reduce(__global const TYPE *A, uint n, __global ACC *B, float shift, __local ACC *scratch) {
     int lid = get_local_id(0);
-    int N = get_local_size(0);
+    uint base = get_group_id(0) * (LOCAL_SIZE * ITEMS) + lid;
+
+    ACC value = base < n ? load(A[base], shift) : IDENTITY;
+#pragma unroll
+    for (int j = 1; j < ITEMS; ++j) {
+        uint index = base + j * LOCAL_SIZE;
+        if (index < n)
+            value = combine(value, load(A[index], shift));
+    }
 
-	//Allocate memory from global to local for faster access
-    local_min[lid] = A[id];
-	//Syncronise workgroups before next stage
+    scratch[lid] = value;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-	//Logically check each variable in the workgroup over stride value of i then i * 2
-	//Store lowest value in the first element 0 of the local memory
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N) {
-            //If next value is less than current, replace current
-            if (local_min[lid + i] < local_min[lid])
-                local_min[lid] = local_min[lid + i];
-        }
+	//Sequential addressing, the upper half folds onto the lower half each step
+#pragma unroll
+    for (int i = LOCAL_SIZE / 2; i > 0; i >>= 1) {
+        if (lid < i)
+            scratch[lid] = combine(scratch[lid], scratch[lid + i]);
 
-		//Syncronise all local workgroups
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    //Calculate minimum sequentially using atomic add which reduces the value to a singular one
     if (lid == 0) {
-        atomic_min(&B[0], local_min[lid]);
+        B[get_group_id(0)] = scratch[0];
     }
 }
 
-__kernel void min_FLOAT(__global const float *A, __global float *B, __local float *local_min) {
-    //Get ID, local ID and width of local workgroup
+#else
+
+//Sorting kernel - Uses a mixture between bitonic sort scan and bucketing the values
+//	Sorts all of the values in the workgroups in acsending order then when kernel
+//	is next execurted the merge flag is flipped so that it will now compute the
+//  inner range sort +N/2 and -N/2 from global width
+__kernel WORKGROUP void sort(__global const TYPE* in, __global TYPE* out, __local TYPE* scratch, int merge)
+{
+	//Get global variables
     int id = get_global_id(0);
     int lid = get_local_id(0);
-    int N = get_local_size(0);
+    int gid = get_group_id(0);
+    int N = LOCAL_SIZE;
 
-    local_min[lid] = A[id];
+	//Get the bounding sides for the inner range
+    int max_group = (get_global_size(0) / N) - 1;
+    int offset_id = id + ((N/2) * merge);
+
+	//If the values are in the outer range edges then assign the global memory at that location to them
+    if (merge && gid == 0)
+    {
+        out[id] = in[id];
+        barrier(CLK_GLOBAL_MEM_FENCE);
+    }
+
+	//Store global memory locally (offset by n/2 * merge)
+    scratch[lid] = in[offset_id];
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N) {
-            //If next value is less than current, replace current
-            if (local_min[lid + i] < local_min[lid])
-                local_min[lid] = local_min[lid + i];
-        }
+	//Reduce over strides until stride is N
+#pragma unroll
+    for (int l=1; l<N; l<<=1)
+    {
+        bool direction = ((lid & (l<<1)) != 0);
 
-        barrier(CLK_LOCAL_MEM_FENCE);
-    }
+		//Reduce over strides until stride is N
+        for (int inc=l; inc>0; inc>>=1)
+        {
+			//Get local postion
+            int j = lid ^ inc;
 
-    //Calculate minimum sequentially using reduction on a single unit
-    if (lid == 0) {
-		//Store all values computed in the workgroup number of B
-		//Logically stores them from 0 to N groups
-        B[get_group_id(0)] = local_min[lid];
-        barrier(CLK_LOCAL_MEM_FENCE);
+			//Store data in variables
+            TYPE i_data = scratch[lid];
+            TYPE j_data = scratch[j];
 
-        if (id == 0) {
-			//Check over all of the local computed values in one cu to reduce to a single value
-            int group_count = get_num_groups(0);
-            for (int i = 1; i < group_count; ++i) {
-                if (B[i] < B[id])
-                    B[id] = B[i];
-            }
-        }
+			//Calculate if it is smaller, if so swap the values.
+            bool smaller = (j_data < i_data) || ( j_data == i_data && j < lid);
+            bool swap = smaller ^ (j < lid) ^ direction;
 
+			//Syncronise local memory
+            barrier(CLK_LOCAL_MEM_FENCE);
+			//Allocate correctly swapped values
+            scratch[lid] = (swap) ? j_data : i_data;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
     }
+
+	//Write to output buffer
+    out[offset_id] = scratch[lid];
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+	//If on edge bound
+    if (merge && gid == max_group)
+        out[offset_id] = in[offset_id];
 }
 
-__kernel void min_WG_REDUCE_FLOAT(__global const float *A, __global float *B, __local float *local_min) {
-    //Get ID, local ID and width of local workgroup
+//Predicate pushdown
+//	Records are filtered on the device against the station id and packed timestamp columns (minutes since 1900).
+//	filter_flags evaluates the predicate once into a byte per record, filter_stats reduces the moments of the
+//	matching records without materialising them and filter_scan/compact perform stream compaction of the subset.
+
+//Shared predicate on the record columns, records past count are padding and never match
+inline bool match_record(int id, uint count, __global const ushort *stations, __global const uint *times,
+                         __global const uchar *station_mask, uint time_from, uint time_to, uint hour_from, uint hour_to) {
+    if (id >= count)
+        return false;
+
+    uint time = times[id];
+    uint hour = (time % 1440) / 60;
+	//Hour ranges such as 22-4 wrap past midnight
+    bool in_hours = hour_from <= hour_to ? (hour >= hour_from && hour <= hour_to) : (hour >= hour_from || hour <= hour_to);
+
+    return station_mask[stations[id]] && time >= time_from && time <= time_to && in_hours;
+}
+
+//Exclusive scan of the flags within each workgroup (Hillis-Steele), the total of every group is written
+//to group_counts so the host can turn them into group offsets for compact
+__kernel WORKGROUP void filter_scan(__global const uchar *flags, __global uint *positions, __global uint *group_counts, __local uint *scratch) {
     int id = get_global_id(0);
     int lid = get_local_id(0);
-    int N = get_local_size(0);
 
-    local_min[lid] = A[id];
+    uint flag = flags[id];
+    scratch[lid] = flag;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N) {
-            //If next value is less than current, replace current
-            if (local_min[lid + i] < local_min[lid])
-                local_min[lid] = local_min[lid + i];
-        }
-
+#pragma unroll
+    for (int i = 1; i < LOCAL_SIZE; i *= 2) {
+        uint add = lid >= i ? scratch[lid - i] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        scratch[lid] += add;
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    //Calculate minimum sequentially by reducing the computed values into the group id of the workgroup
-	//Will be reduced on the host side to eventually only set B[]0] as the summation of all computed workgroups
-    if (lid == 0) {
-        B[get_group_id(0)] = local_min[lid];
-    }
+    positions[id] = scratch[lid] - flag;
+
+    if (lid == LOCAL_SIZE - 1)
+        group_counts[get_group_id(0)] = scratch[lid];
+}
+
+__kernel void filter_flags(__global const TYPE *A, __global const ushort *stations, __global const uint *times,
+                           __global const uchar *station_mask, uint count, uint time_from, uint time_to,
+                           uint hour_from, uint hour_to, TYPE low, TYPE high, __global uchar *flags) {
+    int id = get_global_id(0);
+
+    flags[id] = match_record(id, count, stations, times, station_mask, time_from, time_to, hour_from, hour_to)
+                && A[id] >= low && A[id] <= high;
 }
 
-//max_INT, max_FLOAT, max_WG_REDUCE_FLOAT, sum_INT, sum_FLOAT, sum_WG_REDUCE_FLOAT
-//	all share the same logic as above see comments.
-__kernel void max_INT(__global const int *A, __global int *B, __local int *local_max) {
+//Reduces min, max, count, sum and sum of squares of the matching records in one pass, one partial per workgroup.
+//Every matching value lies inside [low, high] so they are the neutral values for min and max. Squares are taken
+//of the difference from shift so single precision accumulators keep the variance (see moments).
+__kernel WORKGROUP void filter_stats(__global const TYPE *A, __global const uchar *flags, TYPE low, TYPE high, float shift,
+                                     __global TYPE *mins, __global TYPE *maxs, __global uint *counts, __global ACC *sums, __global ACC *squares,
+                                     __local TYPE *local_min, __local TYPE *local_max, __local uint *local_count,
+                                     __local ACC *local_sum, __local ACC *local_square) {
     int id = get_global_id(0);
     int lid = get_local_id(0);
-    int N = get_local_size(0);
 
-    local_max[lid] = A[id];
+    uchar flag = flags[id];
+    ACC value = flag ? A[id] : 0;
+    ACC difference = flag ? value - (ACC) shift : 0;
+    local_min[lid] = flag ? A[id] : high;
+    local_max[lid] = flag ? A[id] : low;
+    local_count[lid] = flag;
+    local_sum[lid] = value;
+    local_square[lid] = difference * difference;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N) {
+#pragma unroll
+    for (int i = LOCAL_SIZE / 2; i > 0; i >>= 1) {
+        if (lid < i) {
+            if (local_min[lid + i] < local_min[lid])
+                local_min[lid] = local_min[lid + i];
             if (local_max[lid + i] > local_max[lid])
                 local_max[lid] = local_max[lid + i];
+            local_count[lid] += local_count[lid + i];
+            local_sum[lid] += local_sum[lid + i];
+            local_square[lid] += local_square[lid + i];
         }
 
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
     if (lid == 0) {
-        atomic_max(&B[0], local_max[lid]);
+        int gid = get_group_id(0);
+        mins[gid] = local_min[0];
+        maxs[gid] = local_max[0];
+        counts[gid] = local_count[0];
+        sums[gid] = local_sum[0];
+        squares[gid] = local_square[0];
     }
 }
 
-__kernel void max_FLOAT(__global const float *A, __global float *B, __local float *local_max) {
+//Scatters the matching records and their columns to offsets[group] + position
+__kernel void compact(__global const TYPE *A, __global const ushort *stations, __global const uint *times,
+                      __global const uchar *flags, __global const uint *positions, __global const uint *offsets,
+                      __global TYPE *out, __global ushort *out_stations, __global uint *out_times) {
     int id = get_global_id(0);
-    int lid = get_local_id(0);
-    int N = get_local_size(0);
-
-    local_max[lid] = A[id];
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N) {
-            if (local_max[lid + i] > local_max[lid])
-                local_max[lid] = local_max[lid + i];
-        }
 
-        barrier(CLK_LOCAL_MEM_FENCE);
+    if (flags[id]) {
+        uint index = offsets[get_group_id(0)] + positions[id];
+        out[index] = A[id];
+        out_stations[index] = stations[id];
+        out_times[index] = times[id];
     }
+}
 
-    if (lid == 0) {
-        B[get_group_id(0)] = local_max[lid];
-
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id == 0) {
+//Arg-min/arg-max and top-k/bottom-k
+//	The record index travels through the reduction with its value. Ties are resolved towards the lowest index so
+//	results do not depend on scheduling, padded records carry the index 0xFFFFFFFF and always lose.
+
+//Returns true if record (a, ai) should come before (b, bi)
+inline bool better(TYPE a, uint ai, TYPE b, uint bi, int find_max) {
+    if (ai == UINT_MAX)
+        return false;
+    if (bi == UINT_MAX)
+        return true;
+    if (a == b)
+        return ai < bi;
+    return find_max ? a > b : a < b;
+}
 
-            int group_count = get_num_groups(0);
-            for (int i = 1; i < group_count; ++i) {
-                if (B[i] > B[id])
-                    B[id] = B[i];
+//Bitonic sort of a workgroup of (value, index) pairs into best first order, local size must be a power of two
+inline void bitonic(__local TYPE *values, __local uint *indices, int lid, int find_max) {
+#pragma unroll
+    for (int size = 2; size <= LOCAL_SIZE; size <<= 1) {
+        for (int stride = size >> 1; stride > 0; stride >>= 1) {
+            int partner = lid ^ stride;
+            if (partner > lid) {
+				//Lower half of each block orders best first, upper half worst first
+                bool ascending = (lid & size) == 0;
+                if (better(values[partner], indices[partner], values[lid], indices[lid], find_max) == ascending) {
+                    TYPE value = values[lid];
+                    uint index = indices[lid];
+                    values[lid] = values[partner];
+                    indices[lid] = indices[partner];
+                    values[partner] = value;
+                    indices[partner] = index;
+                }
             }
+            barrier(CLK_LOCAL_MEM_FENCE);
         }
-
     }
 }
 
-__kernel void max_WG_REDUCE_FLOAT(__global const float *A, __global float *B, __local float *local_max) {
+__kernel WORKGROUP void argextreme(__global const TYPE *A, uint count, int find_max, __global TYPE *B, __global uint *B_indices,
+                                   __local TYPE *local_value, __local uint *local_index) {
     int id = get_global_id(0);
     int lid = get_local_id(0);
-    int N = get_local_size(0);
 
-    local_max[lid] = A[id];
+    local_value[lid] = A[id];
+    local_index[lid] = id < count ? id : UINT_MAX;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N) {
-            if (local_max[lid + i] > local_max[lid])
-                local_max[lid] = local_max[lid + i];
+#pragma unroll
+    for (int i = LOCAL_SIZE / 2; i > 0; i >>= 1) {
+        if (lid < i) {
+            if (better(local_value[lid + i], local_index[lid + i], local_value[lid], local_index[lid], find_max)) {
+                local_value[lid] = local_value[lid + i];
+                local_index[lid] = local_index[lid + i];
+            }
         }
 
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
     if (lid == 0) {
-        B[get_group_id(0)] = local_max[lid];
+        B[get_group_id(0)] = local_value[0];
+        B_indices[get_group_id(0)] = local_index[0];
     }
 }
 
-__kernel void sum_INT(__global const int *A, __global int *B, __local int *local_sum) {
+//Sorts each workgroup and keeps its best k records, k must not exceed half the local size
+__kernel WORKGROUP void topk(__global const TYPE *A, uint count, uint k, int find_max, __global TYPE *B, __global uint *B_indices,
+                             __local TYPE *local_value, __local uint *local_index) {
     int id = get_global_id(0);
     int lid = get_local_id(0);
-    int N = get_local_size(0);
 
-    local_sum[lid] = A[id];
+    local_value[lid] = A[id];
+    local_index[lid] = id < count ? id : UINT_MAX;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N)
-            local_sum[lid] += local_sum[lid + i];
-
-        barrier(CLK_LOCAL_MEM_FENCE);
-    }
+    bitonic(local_value, local_index, lid, find_max);
 
-    if (lid == 0) {
-        atomic_add(&B[0], local_sum[lid]);
+    if (lid < k) {
+        B[get_group_id(0) * k + lid] = local_value[lid];
+        B_indices[get_group_id(0) * k + lid] = local_index[lid];
     }
 }
 
-__kernel void sum_FLOAT(__global const float *A, __global float *B, __local float *local_sum) {
+//Merges the candidates of the previous round, count is the number of candidates in A
+__kernel WORKGROUP void topk_merge(__global const TYPE *A, __global const uint *A_indices, uint count, uint k, int find_max,
+                                   __global TYPE *B, __global uint *B_indices, __local TYPE *local_value, __local uint *local_index) {
     int id = get_global_id(0);
     int lid = get_local_id(0);
-    int N = get_local_size(0);
 
-    local_sum[lid] = A[id];
+    local_value[lid] = id < count ? A[id] : 0;
+    local_index[lid] = id < count ? A_indices[id] : UINT_MAX;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N)
-            local_sum[lid] += local_sum[lid + i];
+    bitonic(local_value, local_index, lid, find_max);
 
-        barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < k) {
+        B[get_group_id(0) * k + lid] = local_value[lid];
+        B_indices[get_group_id(0) * k + lid] = local_index[lid];
     }
+}
 
-    if (lid == 0) {
-        B[get_group_id(0)] = local_sum[lid];
-
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id == 0) {
-
-            int group_count = get_num_groups(0);
-            for (int i = 1; i < group_count; ++i) {
-                B[id] += B[i];
-            }
-        }
+//Z-score anomaly detection
+//	group_moments accumulates count, sum and sum of squares per record group (station, month or both) in local memory.
+//	A fixed number of workgroups loop over the data so the per group partials stay small whatever the data size.
+//	OpenCL 1.1 only has 32-bit local atomics so the 64-bit sums are kept as lo/hi words with an explicit carry,
+//	values are summed as fixed point (fixed_scale units per stored unit) so the totals stay exact.
+//	group_baseline turns the partials into a mean and std per group, anomaly_flags flags records whose
+//	z-score exceeds the threshold of their group and filter_scan/compact gather the flagged records.
+
+//Month (0-11) of a packed timestamp, days are counted from 0000-03-01 as in Records::UnpackTimestamp
+inline uint timestamp_month(uint time) {
+    uint days = time / 1440 + 693901;
+    uint doe = days % 146097;
+    uint yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint mp = (5 * doy + 2) / 153;
+    return mp < 10 ? mp + 2 : mp - 10;
+}
 
+//Group id of a record, matches Records::GroupOf
+inline uint record_group(ushort station, uint time, int group_by) {
+    switch (group_by) {
+        case 1: return station;
+        case 2: return timestamp_month(time);
+        case 3: return station * 12 + timestamp_month(time);
+        default: return 0;
     }
 }
 
-__kernel void sum_WG_REDUCE_FLOAT(__global const float *A, __global float *B, __local float *local_sum) {
-    int id = get_global_id(0);
-    int lid = get_local_id(0);
-    int N = get_local_size(0);
-
-    local_sum[lid] = A[id];
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N)
-            local_sum[lid] += local_sum[lid + i];
+//Adds a 64-bit value to a lo/hi pair of local words, carries are commutative so the total is exact
+inline void atomic_add_wide(__local volatile uint *acc, ulong value) {
+    uint lo = (uint) value;
+    uint hi = (uint) (value >> 32);
+    uint old = atomic_add(&acc[0], lo);
+    if (old + lo < old)
+        hi += 1;
+    atomic_add(&acc[1], hi);
+}
 
-        barrier(CLK_LOCAL_MEM_FENCE);
+//Sums the partials of every workgroup for each group, one work item per group id
+__kernel void group_baseline(__global const ulong *partials, uint workgroups, uint chunk, uint group_offset, float fixed_scale,
+                             __global float *means, __global float *stds) {
+    uint g = get_global_id(0);
+    if (g >= chunk)
+        return;
+
+    ulong count = 0;
+    long sum = 0, squares = 0;
+    for (uint w = 0; w < workgroups; ++w) {
+        count += partials[(w * chunk + g) * 3];
+        sum += (long) partials[(w * chunk + g) * 3 + 1];
+        squares += (long) partials[(w * chunk + g) * 3 + 2];
     }
 
-    if (lid == 0) {
-        B[get_group_id(0)] = local_sum[lid];
-    }
+	//Mean and std in storage units, an empty group has a std of zero and never flags
+    acc_float mean = count ? (acc_float) sum / count : 0;
+    acc_float variance = count ? ((acc_float) squares - mean * sum) / count : 0;
+    means[group_offset + g] = mean / fixed_scale;
+    stds[group_offset + g] = variance > 0 ? sqrt(variance) / fixed_scale : 0;
 }
 
-//Utilty functions to square integers and float
-inline int square_int(int a) {
-    return a * a;
-}
+//Scatters the index of every flagged record to offsets[group] + position
+__kernel void compact_indices(__global const uchar *flags, __global const uint *positions, __global const uint *offsets,
+                              __global uint *out_indices) {
+    int id = get_global_id(0);
 
-inline float square_flt(float a) {
-    return a * a;
+    if (flags[id])
+        out_indices[offsets[get_group_id(0)] + positions[id]] = id;
 }
 
-__kernel void std_INT(__global const int *A, __global int *B, float mean_f, __local int *local_std) {
-    //Get ID, local ID and width of local workgroup
-    int id = get_global_id(0);
+//Grid stride loop over the records, only groups in [group_offset, group_offset + chunk) are accumulated
+__kernel WORKGROUP void group_moments(__global const TYPE *A, __global const ushort *stations, __global const uint *times, uint count,
+                                      int group_by, uint group_offset, uint chunk, float fixed_scale,
+                                      __global ulong *partials, __local volatile uint *local_acc) {
     int lid = get_local_id(0);
-    int N = get_local_size(0);
-
-	//Convert the mean to a float value as it is not an int in the host code.
-    int mean = (int) mean_f;
 
-	//Move squared difference global memory to local for summation (Sum reduce logic_ 
-    local_std[lid] = square_int(A[id] - mean);
+	//Five words per group: count, sum lo/hi and sum of squares lo/hi
+    for (uint i = lid; i < chunk * 5; i += LOCAL_SIZE)
+        local_acc[i] = 0;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-	//Sum squared differences
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N)
-            local_std[lid] += local_std[lid + i];
+    for (uint id = get_global_id(0); id < count; id += get_global_size(0)) {
+        uint g = record_group(stations[id], times[id], group_by) - group_offset;
+        if (g >= chunk)
+            continue;
+
+#ifdef TYPE_FLOAT
+        long value = (long) round(A[id] * fixed_scale);
+#else
+        long value = (long) A[id];
+#endif
+        atomic_inc(&local_acc[g * 5]);
+        atomic_add_wide(&local_acc[g * 5 + 1], (ulong) value);
+        atomic_add_wide(&local_acc[g * 5 + 3], (ulong) (value * value));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-        barrier(CLK_LOCAL_MEM_FENCE);
+    uint gid = get_group_id(0);
+    for (uint g = lid; g < chunk; g += LOCAL_SIZE) {
+        partials[(gid * chunk + g) * 3] = local_acc[g * 5];
+        partials[(gid * chunk + g) * 3 + 1] = (ulong) local_acc[g * 5 + 1] | ((ulong) local_acc[g * 5 + 2] << 32);
+        partials[(gid * chunk + g) * 3 + 2] = (ulong) local_acc[g * 5 + 3] | ((ulong) local_acc[g * 5 + 4] << 32);
     }
+}
 
-    if (lid == 0) {
-        atomic_add(&B[0], local_std[lid]);
+__kernel void anomaly_flags(__global const TYPE *A, __global const ushort *stations, __global const uint *times, uint count,
+                            int group_by, __global const float *means, __global const float *stds,
+                            __global const float *thresholds, __global uchar *flags) {
+    int id = get_global_id(0);
+
+    if (id >= count) {
+        flags[id] = 0;
+        return;
     }
+
+    uint g = record_group(stations[id], times[id], group_by);
+    flags[id] = stds[g] > 0 && fabs(A[id] - means[g]) > thresholds[g] * stds[g];
 }
 
-__kernel void std_manual_INT(__global const int *A, __global int *B, float mean_f, __local int *local_std) {
+//Quantile sketch compaction
+//	Each workgroup sorts its chunk and keeps every other value starting at offset, halving the data while every kept
+//	value stands for two. Repeated on the samples this builds the upper levels of QuantileSketch on the device.
+//	Only full workgroups are compacted, the host inserts anything left over at its level.
+__kernel WORKGROUP void sketch_compact(__global const TYPE *A, uint offset, __global TYPE *B,
+                                       __local TYPE *local_value, __local uint *local_index) {
     int id = get_global_id(0);
     int lid = get_local_id(0);
-    int N = get_local_size(0);
-    int mean = (int) mean_f;
 
-    local_std[lid] = square_int(A[id] - mean);
+    local_value[lid] = A[id];
+    local_index[lid] = id;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N)
-            local_std[lid] += local_std[lid + i];
+    bitonic(local_value, local_index, lid, 0);
 
-        barrier(CLK_LOCAL_MEM_FENCE);
-    }
+    if (lid < LOCAL_SIZE / 2)
+        B[get_group_id(0) * (LOCAL_SIZE / 2) + lid] = local_value[lid * 2 + offset];
+}
 
+//Key-value sort
+//	Records are ordered by a 64-bit key with their index as the payload, ties resolve towards the lower index so the
+//	order is stable. Keys are either the value mapped to an unsigned integer with the same order or the station id
+//	above the packed timestamp (or the reverse). The host pads the keys to a power of two with ULONG_MAX (ordered last) and runs a
+//	bitonic network with a known number of passes: key_sort_local sorts each workgroup, then for every larger block
+//	size the strides at or above the local size run as key_sort_global passes and the rest as one key_sort_local merge.
+
+//Unsigned key with the same order as the value
+inline ulong value_key(TYPE a) {
+#ifdef TYPE_FLOAT
+    float value = a;
+    uint bits = as_uint(value);
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+#else
+    return (uint) ((int) a) ^ 0x80000000u;
+#endif
+}
 
-    if (lid == 0) {
-        B[get_group_id(0)] = local_std[lid];
+inline bool key_before(ulong a, uint ai, ulong b, uint bi) {
+    return a < b || (a == b && ai < bi);
+}
 
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id == 0) {
+__kernel void sort_keys_value(__global const TYPE *A, uint count, __global ulong *keys, __global uint *indices) {
+    uint id = get_global_id(0);
 
-            int group_count = get_num_groups(0);
-            for (int i = 1; i < group_count; ++i) {
-                B[id] += B[i];
-            }
+    keys[id] = id < count ? value_key(A[id]) : ULONG_MAX;
+    indices[id] = id;
+}
 
-            B[id] = sqrt((float) B[id] / get_global_size(0));
-        }
+//Station above timestamp, or timestamp above station when time_first is set
+__kernel void sort_keys_record(__global const ushort *stations, __global const uint *times, uint count, uint time_first,
+                               __global ulong *keys, __global uint *indices) {
+    uint id = get_global_id(0);
 
+	//The columns only hold the data size, the rest of the power of two range is sentinel keys
+    indices[id] = id;
+    if (id >= count) {
+        keys[id] = ULONG_MAX;
+        return;
     }
+    keys[id] = time_first ? ((ulong) times[id] << 16) | stations[id] : ((ulong) stations[id] << 32) | times[id];
 }
 
-__kernel void std_FLOAT(__global const float *A, __global float *B, float mean, __local float *local_std) {
-    int id = get_global_id(0);
+//size == 0 sorts every workgroup (block sizes 2 to LOCAL_SIZE), otherwise merges blocks of size for the strides below LOCAL_SIZE
+__kernel WORKGROUP void key_sort_local(__global ulong *keys, __global uint *indices, uint size,
+                                       __local ulong *local_key, __local uint *local_index) {
+    uint id = get_global_id(0);
     int lid = get_local_id(0);
-    int N = get_local_size(0);
 
-    local_std[lid] = square_flt(A[id] - mean);
+    local_key[lid] = keys[id];
+    local_index[lid] = indices[id];
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int i = 1; i < N; i *= 2) {
-        if (lid % (i * 2) == 0 && lid + i < N)
-            local_std[lid] += local_std[lid + i];
-
-        barrier(CLK_LOCAL_MEM_FENCE);
+    uint first = size ? size : 2, last = size ? size : LOCAL_SIZE;
+    for (uint block = first; block <= last; block <<= 1) {
+		//Blocks sort ascending or descending by their position so every larger block is bitonic
+        bool ascending = (id & block) == 0;
+        for (int stride = min(block, (uint) LOCAL_SIZE) >> 1; stride > 0; stride >>= 1) {
+            int partner = lid ^ stride;
+            if (partner > lid && key_before(local_key[partner], local_index[partner], local_key[lid], local_index[lid]) == ascending) {
+                ulong key = local_key[lid];
+                uint index = local_index[lid];
+                local_key[lid] = local_key[partner];
+                local_index[lid] = local_index[partner];
+                local_key[partner] = key;
+                local_index[partner] = index;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
     }
 
-    if (lid == 0) {
-        B[get_group_id(0)] = local_std[lid];
-
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id == 0) {
-
-            int group_count = get_num_groups(0);
-            for (int i = 1; i < group_count; ++i) {
-                B[id] += B[i];
-            }
+    keys[id] = local_key[lid];
+    indices[id] = local_index[lid];
+}
 
-            B[id] = sqrt(B[id] / (get_global_size(0) - 1));
-        }
+//One compare and swap per pair, strides of at least LOCAL_SIZE cross workgroups
+__kernel void key_sort_global(__global ulong *keys, __global uint *indices, uint size, uint stride) {
+    uint id = get_global_id(0);
+    uint partner = id ^ stride;
+
+    if (partner > id && key_before(keys[partner], indices[partner], keys[id], indices[id]) == ((id & size) == 0)) {
+        ulong key = keys[id];
+        uint index = indices[id];
+        keys[id] = keys[partner];
+        indices[id] = indices[partner];
+        keys[partner] = key;
+        indices[partner] = index;
     }
 }
 
-//Sorting kernel - Uses a mixture between bitonic sort scan and bucketing the values
-//	Sorts all of the values in the workgroups in acsending order then when kernel
-//	is next execurted the merge flag is flipped so that it will now compute the
-//  inner range sort +N/2 and -N/2 from global width
-__kernel void sort_INT(__global const int* in, __global int* out, __local int* scratch, int merge)
-{
-	//Get global variables
+//Reorders the values, and the record columns with key_gather_columns, into sorted order
+__kernel void key_gather(__global const TYPE *A, __global const uint *indices, __global TYPE *out) {
     int id = get_global_id(0);
-    int lid = get_local_id(0);
-    int gid = get_group_id(0);
-    int N = get_local_size(0);
-
-	//Get the bounding sides for the inner range
-    int max_group = (get_global_size(0) / N) - 1;
-    int offset_id = id + ((N/2) * merge);
 
-	//If the values are in the outer range edges then assign the global memory at that location to them
-    if (merge && gid == 0)
-    {
-        out[id] = in[id];
-        barrier(CLK_GLOBAL_MEM_FENCE);
-    }
+    out[id] = A[indices[id]];
+}
 
-	//Store global memory locally (offset by n/2 * merge)
-    scratch[lid] = in[offset_id];
-    barrier(CLK_LOCAL_MEM_FENCE);
+__kernel void key_gather_columns(__global const ushort *stations, __global const uint *times, __global const uint *indices,
+                                 __global ushort *out_stations, __global uint *out_times) {
+    int id = get_global_id(0);
 
-	//Reduce over strides until stride is N
-    for (int l=1; l<N; l<<=1)
-    {
-        bool direction = ((lid & (l<<1)) != 0);
+    out_stations[id] = stations[indices[id]];
+    out_times[id] = times[indices[id]];
+}
 
-		//Reduce over strides until stride is N
-        for (int inc=l; inc>0; inc>>=1)
-        {
-			//Get local postion
-            int j = lid ^ inc;
+//Fused statistics
+//	moments reduces every moment of the data in one pass and key_histogram selects exact quantiles by radix on the
+//	order preserving keys of value_key, so the query planner never needs a pass per statistic or a full sort.
 
-			//Store data in variables
-            int i_data = scratch[lid];
-            int j_data = scratch[j];
+//Min, max, sum and sum of squared differences from shift of the first count values, one partial of each per
+//workgroup. Values past count are padding and are neutral for every moment so the host needs no correction.
+__kernel WORKGROUP void moments(__global const TYPE *A, uint count, float shift,
+                                __global TYPE *mins, __global TYPE *maxs, __global ACC *sums, __global ACC *squares,
+                                __local TYPE *local_min, __local TYPE *local_max, __local ACC *local_sum, __local ACC *local_square) {
+    uint id = get_global_id(0);
+    int lid = get_local_id(0);
 
-			//Calculate if it is smaller, if so swap the values.
-            bool smaller = (j_data < i_data) || ( j_data == i_data && j < lid);
-            bool swap = smaller ^ (j < lid) ^ direction;
+    bool valid = id < count;
+    TYPE value = valid ? A[id] : 0;
+    ACC difference = valid ? (ACC) value - (ACC) shift : 0;
+    local_min[lid] = valid ? value : TYPE_MAX;
+    local_max[lid] = valid ? value : TYPE_MIN;
+    local_sum[lid] = valid ? (ACC) value : 0;
+    local_square[lid] = difference * difference;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-			//Syncronise local memory
-            barrier(CLK_LOCAL_MEM_FENCE);
-			//Allocate correctly swapped values
-            scratch[lid] = (swap) ? j_data : i_data;
-            barrier(CLK_LOCAL_MEM_FENCE);
+#pragma unroll
+    for (int i = LOCAL_SIZE / 2; i > 0; i >>= 1) {
+        if (lid < i) {
+            if (local_min[lid + i] < local_min[lid])
+                local_min[lid] = local_min[lid + i];
+            if (local_max[lid + i] > local_max[lid])
+                local_max[lid] = local_max[lid + i];
+            local_sum[lid] += local_sum[lid + i];
+            local_square[lid] += local_square[lid + i];
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-	//Write to output buffer
-    out[offset_id] = scratch[lid];
-    barrier(CLK_GLOBAL_MEM_FENCE);
-
-	//If on edge bound 
-    if (merge && gid == max_group)
-        out[offset_id] = in[offset_id];
+    if (lid == 0) {
+        int group = get_group_id(0);
+        mins[group] = local_min[0];
+        maxs[group] = local_max[0];
+        sums[group] = local_sum[0];
+        squares[group] = local_square[0];
+    }
 }
 
-__kernel void sort_FLOAT(__global const float* in, __global float* out, __local float* scratch, int merge)
-{
-    int id = get_global_id(0);
-    int lid = get_local_id(0);
-    int gid = get_group_id(0);
-    int N = get_local_size(0);
+//Radix selection histogram. Level 0 counts every value by the upper 16 bits of its key, level 1 counts the values
+//whose upper 16 bits equal prefix by the lower 16 bits.
+__kernel void key_histogram(__global const TYPE *A, uint count, uint level, uint prefix, __global uint *bins) {
+    uint id = get_global_id(0);
 
-    int max_group = (get_global_size(0) / N) - 1;
-    int offset_id = id + ((N/2) * merge);
+    if (id >= count)
+        return;
 
-    if (merge && gid == 0)
-    {
-        out[id] = in[id];
-        barrier(CLK_GLOBAL_MEM_FENCE);
-    }
+    uint key = (uint) value_key(A[id]);
+    if (level == 0)
+        atomic_inc(&bins[key >> 16]);
+    else if ((key >> 16) == prefix)
+        atomic_inc(&bins[key & 0xFFFF]);
+}
 
-    scratch[lid] = in[offset_id];
-    barrier(CLK_LOCAL_MEM_FENCE);
+//Cross-station correlation
+//	Records sorted by timestamp then station are joined on the timestamp: align_flags marks the first record of every
+//	timestamp, filter_scan numbers them and align_scatter writes every value to its (timestamp row, station column)
+//	of a dense matrix X with a presence mask M. pair_moments then reduces every pair of columns over the rows where
+//	both are present, tile by tile through local memory, giving the sums behind covariance and correlation.
+#ifndef TILE
+#define TILE 16
+#endif
 
-    for (int l=1; l<N; l<<=1)
-    {
-        bool direction = ((lid & (l<<1)) != 0);
+__kernel void align_flags(__global const uint *times, uint count, __global uchar *flags) {
+    uint id = get_global_id(0);
 
-        for (int inc=l; inc>0; inc>>=1)
-        {
-            int j = lid ^ inc;
-            float i_data = scratch[lid];
-            float j_data = scratch[j];
+    flags[id] = id < count && (id == 0 || times[id] != times[id - 1]);
+}
 
-            bool smaller = (j_data < i_data) || ( j_data == i_data && j < lid);
-            bool swap = smaller ^ (j < lid) ^ direction;
+//Row of a record is the number of timestamps started up to and including it, minus one. Values are stored relative
+//to shift so the single precision sums of squares keep their precision.
+__kernel void align_scatter(__global const TYPE *A, __global const ushort *stations, __global const uchar *flags,
+                            __global const uint *positions, __global const uint *offsets, uint count, float shift,
+                            uint stride, __global float *X, __global uchar *M) {
+    uint id = get_global_id(0);
 
-            barrier(CLK_LOCAL_MEM_FENCE);
+    if (id >= count)
+        return;
 
-            scratch[lid] = (swap) ? j_data : i_data;
-            barrier(CLK_LOCAL_MEM_FENCE);
+    uint row = offsets[get_group_id(0)] + positions[id] + flags[id] - 1;
+    X[row * stride + stations[id]] = (float) A[id] - shift;
+    M[row * stride + stations[id]] = 1;
+}
+
+//Work item (a, b) of a TILE x TILE workgroup accumulates pair (a, b) over one split of the rows, the two TILE x TILE
+//blocks of rows it needs are loaded once per workgroup and shared. Dimension 1 holds splits * stride columns so
+//long series are spread over many workgroups, partials holds six stride x stride matrices per split:
+//	0 - rows both present, 1 - sum of a, 2 - sum of b, 3 - sum of a^2, 4 - sum of b^2, 5 - sum of a * b
+__kernel void pair_moments(__global const float *X, __global const uchar *M, uint stride, uint rows, uint splits,
+                           __global acc_float *partials, __local float *xa, __local float *xb,
+                           __local float *ma, __local float *mb) {
+    int la = get_local_id(0), lb = get_local_id(1);
+    uint a = get_global_id(0);
+    uint b = get_global_id(1) % stride;
+    uint split = get_global_id(1) / stride;
+    uint tile_a = a - la, tile_b = b - lb;
+
+    uint split_rows = ((rows / TILE + splits - 1) / splits) * TILE;
+    uint first = split * split_rows, last = min(rows, first + split_rows);
+
+    acc_float n = 0, sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+    for (uint r = first; r < last; r += TILE) {
+		//Each work item loads one element of each block, row r + lb and column la (coalesced along la)
+        uint row = (r + lb) * stride;
+        xa[lb * TILE + la] = X[row + tile_a + la];
+        ma[lb * TILE + la] = M[row + tile_a + la];
+        xb[lb * TILE + la] = X[row + tile_b + la];
+        mb[lb * TILE + la] = M[row + tile_b + la];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+#pragma unroll
+        for (int k = 0; k < TILE; ++k) {
+            float x = xa[k * TILE + la], y = xb[k * TILE + lb];
+            float in_a = ma[k * TILE + la], in_b = mb[k * TILE + lb];
+			//Missing values are stored as zero so only the masks of the other column are needed
+            n += in_a * in_b;
+            sa += x * in_b;
+            sb += y * in_a;
+            saa += x * x * in_b;
+            sbb += y * y * in_a;
+            sab += x * y;
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    out[offset_id] = scratch[lid];
-    barrier(CLK_GLOBAL_MEM_FENCE);
-
-    if (merge && gid == max_group)
-        out[offset_id] = in[offset_id];
+    uint matrix = stride * stride, index = a * stride + b;
+    __global acc_float *out = partials + split * 6 * matrix;
+    out[index] = n;
+    out[matrix + index] = sa;
+    out[2 * matrix + index] = sb;
+    out[3 * matrix + index] = saa;
+    out[4 * matrix + index] = sbb;
+    out[5 * matrix + index] = sab;
 }
+
+#endif
@@ -0,0 +1,98 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+//Synthetic Corpus Generator
+// Writes files in the six column format of data/temp_lincolnshire_short.txt (STATION YYYY MM DD HHMM VALUE) so the
+// parsers and the device can be measured on 10M-1B lines. Every station gets a contiguous block of readings spread
+// evenly over the years, temperatures follow a seasonal and daily cycle around the station mean plus gaussian noise.
+//
+// Usage: GenerateCorpus <output file> <lines> [-n stations] [-y first year] [-e years] [-r seed]
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include "../SimpleTimer.hpp"
+#include "../Records.hpp"
+
+//Real station names first, further stations are numbered
+static const char *STATION_NAMES[] = {"BARKSTON_HEATH", "CONINGSBY", "CRANWELL", "SCAMPTON", "WADDINGTON"};
+
+std::string StationName(unsigned int station) {
+	unsigned int named = sizeof(STATION_NAMES) / sizeof(STATION_NAMES[0]);
+	return station < named ? STATION_NAMES[station] : "STATION_" + std::to_string(station);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		std::cerr << "Usage: GenerateCorpus <output file> <lines> [-n stations] [-y first year] [-e years] [-r seed]" << std::endl;
+		return 1;
+	}
+
+	std::string output_path = argv[1];
+	unsigned long long lines = strtoull(argv[2], NULL, 10);
+	unsigned int stations = 5, seed = 14474219;
+	int first_year = 1929, years = 88;
+	for (int i = 3; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-n") == 0) stations = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-y") == 0) first_year = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-e") == 0) years = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-r") == 0) seed = (unsigned int) atoi(argv[++i]);
+	}
+
+	std::ofstream output(output_path, std::ios::out | std::ios::binary);
+	if (!output)
+		throw std::runtime_error("ERROR: Could not open " + output_path + " for writing.");
+
+	std::mt19937_64 generator(seed);
+	std::normal_distribution<double> noise(0.0, 2.5);
+	std::uniform_real_distribution<double> station_mean(8.0, 11.0);
+
+	const double two_pi = 6.283185307179586;
+	uint32_t first_minute = Records::PackTimestamp(first_year, 1, 1, 0);
+	double span = (double) (Records::PackTimestamp(first_year + years, 1, 1, 0) - first_minute);
+
+	//Lines are formatted into a large buffer and written in blocks
+	std::vector<char> buffer(1 << 24);
+	std::size_t used = 0;
+	SimpleTimer t;
+	t.Tic();
+
+	for (unsigned int station = 0; station < stations; ++station) {
+		std::string name = StationName(station);
+		double mean = station_mean(generator);
+		unsigned long long count = lines / stations + (station < lines % stations ? 1 : 0);
+		double step = span / std::max<unsigned long long>(count, 1);
+
+		for (unsigned long long i = 0; i < count; ++i) {
+			uint32_t timestamp = first_minute + (uint32_t) (i * step);
+			int year;
+			unsigned int month, day, hhmm;
+			Records::UnpackTimestamp(timestamp, year, month, day, hhmm);
+
+			//Coldest mid January and around 3am, warmest mid July and around 3pm
+			double day_of_year = fmod((timestamp - first_minute) / 1440.0, 365.2425);
+			double hour = (timestamp % 1440u) / 60.0;
+			double value = mean - 6.5 * cos(two_pi * (day_of_year - 15.0) / 365.2425)
+						   - 4.0 * cos(two_pi * (hour - 3.0) / 24.0) + noise(generator);
+
+			if (buffer.size() - used < 128) {
+				output.write(&buffer[0], used);
+				used = 0;
+			}
+			used += snprintf(&buffer[used], buffer.size() - used, "%s %04d %02u %02u %04u %.1f\n",
+							 name.c_str(), year, month, day, hhmm, value);
+		}
+	}
+	output.write(&buffer[0], used);
+	output.close();
+
+	std::cout << "Generated " << lines << " lines from " << stations << " stations in " << t.Toc() / 1000000 << "ms" << std::endl;
+	return 0;
+}
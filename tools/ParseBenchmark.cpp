@@ -0,0 +1,148 @@
+//Raymond Kirk - 14474219@students.lincoln.ac.uk
+
+//Parser Throughput Benchmark
+// Measures every parse mode of Parser.hpp and StreamParser.hpp on each input file (see GenerateCorpus for files of
+// any size) and reports MB/s of the file on disk and lines/s, the threaded modes are measured at every thread count.
+// Compressed (.gz/.zst) files are only read by FileEOLStream. The first run of each file also warms the page
+// cache, every mode then reports its best of the repeats so the numbers reflect parsing rather than the disk.
+//
+// Usage: ParseBenchmark [-t 1,2,4,8] [-r repeats] [-y short|int|float] <file>...
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <cstdlib>
+#include "../SimpleTimer.hpp"
+#include "../Parser.hpp"
+#include "../StreamParser.hpp"
+
+struct BenchmarkOptions {
+	std::vector<unsigned int> threads;
+	unsigned int repeats = 3;
+};
+
+//Best time in seconds of the repeats, every run parses into a fresh vector
+template<typename T>
+double BestTime(unsigned int repeats, std::size_t &lines, const std::function<void(std::vector<T> &)> &parse) {
+	double best = 0;
+	for (unsigned int r = 0; r < repeats; ++r) {
+		std::vector<T> data;
+		SimpleTimer t;
+		t.Tic();
+		parse(data);
+		double seconds = t.Toc() / 1e9;
+		best = r == 0 ? seconds : std::min(best, seconds);
+		lines = data.size();
+	}
+	return best;
+}
+
+void PrintRow(const std::string &mode, std::size_t bytes, std::size_t lines, double seconds) {
+	std::cout << "\t" << std::left << std::setw(24) << mode << std::right << std::fixed << std::setprecision(1)
+			  << std::setw(12) << bytes / 1e6 / seconds << std::setw(16) << lines / seconds << std::setw(12) << seconds * 1000 << std::endl;
+}
+
+template<typename T>
+void Benchmark(const std::string &file_path, const BenchmarkOptions &options) {
+	std::ifstream input_file(file_path, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!input_file)
+		throw std::runtime_error("ERROR: Could not open " + file_path + ".");
+	std::size_t bytes = input_file.tellg();
+
+	//Magic bytes decide which modes can read the file
+	std::vector<char> magic(4, 0);
+	input_file.seekg(0, std::ios_base::beg);
+	input_file.read(&magic[0], magic.size());
+	magic.resize(input_file.gcount());
+	input_file.close();
+
+	std::size_t lines = 0;
+	std::cout << file_path << " (" << bytes / 1e6 << " MB):\n\t" << std::left << std::setw(24) << "Mode" << std::right
+			  << std::setw(12) << "MB/s" << std::setw(16) << "Lines/s" << std::setw(12) << "ms" << std::endl;
+
+	double seconds = 0;
+	if (Parse::DetectCompression(magic) != Parse::PLAIN) {
+		for (unsigned int threads : options.threads) {
+			seconds = BestTime<T>(options.repeats, lines, [&](std::vector<T> &data) {
+				Parse::FileEOLStream(file_path, data, threads);
+			});
+			PrintRow("FileEOLStream x" + std::to_string(threads), bytes, lines, seconds);
+		}
+		std::cout << std::endl;
+		return;
+	}
+
+	seconds = BestTime<T>(options.repeats, lines, [&](std::vector<T> &data) {
+		Parse::FileEOL(file_path, data);
+	});
+	PrintRow("FileEOL", bytes, lines, seconds);
+
+	for (unsigned int threads : options.threads) {
+		seconds = BestTime<T>(options.repeats, lines, [&](std::vector<T> &data) {
+			Parse::FileEOLParallel(file_path, data, threads);
+		});
+		PrintRow("FileEOLParallel x" + std::to_string(threads), bytes, lines, seconds);
+	}
+
+	for (unsigned int threads : options.threads) {
+		seconds = BestTime<T>(options.repeats, lines, [&](std::vector<T> &data) {
+			Parse::FileEOLStream(file_path, data, threads);
+		});
+		PrintRow("FileEOLStream x" + std::to_string(threads), bytes, lines, seconds);
+	}
+
+	seconds = BestTime<T>(options.repeats, lines, [&](std::vector<T> &data) {
+		Records::Columns columns;
+		Parse::FileRecords(file_path, data, columns);
+	});
+	PrintRow("FileRecords", bytes, lines, seconds);
+	std::cout << std::endl;
+}
+
+int main(int argc, char **argv) {
+	BenchmarkOptions options;
+	std::string type = "short";
+	std::vector<std::string> files;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			std::stringstream list(argv[++i]);
+			std::string item;
+			while (std::getline(list, item, ','))
+				options.threads.push_back(std::max(1, atoi(item.c_str())));
+		}
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			options.repeats = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-y") == 0 && i + 1 < argc)
+			type = argv[++i];
+		else
+			files.push_back(argv[i]);
+	}
+
+	if (files.empty()) {
+		std::cerr << "Usage: ParseBenchmark [-t 1,2,4,8] [-r repeats] [-y short|int|float] <file>..." << std::endl;
+		return 1;
+	}
+
+	//Powers of two up to the hardware threads by default
+	if (options.threads.empty())
+		for (unsigned int threads = 1; threads <= std::max(1u, std::thread::hardware_concurrency()); threads *= 2)
+			options.threads.push_back(threads);
+
+	for (auto const &file_path : files) {
+		if (type == "float")
+			Benchmark<float>(file_path, options);
+		else if (type == "int")
+			Benchmark<int>(file_path, options);
+		else
+			Benchmark<int16_t>(file_path, options);
+	}
+	return 0;
+}